@@ -176,6 +176,14 @@ class Arena {
   const void* Tip() const { return reinterpret_cast<const void*>(top_->tip); }
   size_t TipSize() const { return top_->end - top_->tip; }
 
+  // Returns the total size of all blocks owned by the arena. This is an upper bound on the
+  // memory taken by allocations.
+  size_t BlockBytes() const {
+    size_t res = 0;
+    for (const Block& b : blocks_) res += b.size();
+    return res;
+  }
+
   // Invalidates all allocations (without running destructors of allocated objects) and frees all
   // blocks except at most the specified number of blocks. The retained blocks will be used to
   // fulfil future allocation requests.
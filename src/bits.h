@@ -19,11 +19,42 @@
 #define ROMKATV_GITSTATUS_BITS_H_
 
 #include <cstddef>
+#include <cstdint>
 
 namespace gitstatus {
 
 inline size_t NextPow2(size_t n) { return n < 2 ? 1 : (~size_t{0} >> __builtin_clzll(n - 1)) + 1; }
 
+// Big-endian integers as found in git's on-disk formats.
+inline uint16_t Be16(const char* p) {
+  return static_cast<unsigned char>(p[0]) << 8 | static_cast<unsigned char>(p[1]);
+}
+
+inline uint32_t Be32(const char* p) {
+  return uint32_t{Be16(p)} << 16 | Be16(p + 2);
+}
+
+inline uint64_t Be64(const char* p) {
+  return uint64_t{Be32(p)} << 32 | Be32(p + 4);
+}
+
+// Decodes an integer written by git's encode_varint() and advances `p` past it. Returns false on
+// overflow or if the input ends prematurely.
+inline bool Varint(const char*& p, const char* end, size_t& res) {
+  if (p == end) return false;
+  unsigned char c = *p++;
+  size_t val = c & 127;
+  while (c & 128) {
+    if (p == end) return false;
+    ++val;
+    if (!val || val >> (8 * sizeof(val) - 7)) return false;
+    c = *p++;
+    val = (val << 7) + (c & 127);
+  }
+  res = val;
+  return true;
+}
+
 }  // namespace gitstatus
 
 #endif  // ROMKATV_GITSTATUS_BITS_H_
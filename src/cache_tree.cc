@@ -0,0 +1,93 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "cache_tree.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace gitstatus {
+
+namespace {
+
+bool NameLt(StringView x, StringView y) {
+  return x.len != y.len ? x.len < y.len : std::memcmp(x.ptr, y.ptr, x.len) < 0;
+}
+
+// Parses an ASCII decimal number terminated by `term`.
+bool ReadNum(const char*& p, const char* e, char term, int64_t& res) {
+  bool neg = p != e && *p == '-';
+  if (neg) ++p;
+  if (p == e || *p < '0' || *p > '9') return false;
+  res = 0;
+  for (; p != e && *p >= '0' && *p <= '9'; ++p) {
+    if (res > (INT64_MAX - 9) / 10) return false;
+    res = 10 * res + (*p - '0');
+  }
+  if (p == e || *p != term) return false;
+  ++p;
+  if (neg) res = -res;
+  return true;
+}
+
+bool ReadNode(const char*& p, const char* e, size_t depth, CacheTree& node) {
+  // Real trees are nowhere near this deep. The limit protects the stack from corrupted input.
+  if (depth > 4096) return false;
+  const char* nul = static_cast<const char*>(std::memchr(p, 0, e - p));
+  if (!nul) return false;
+  node.name = StringView(p, nul);
+  p = nul + 1;
+
+  int64_t num_subtrees;
+  if (!ReadNum(p, e, ' ', node.entry_count) || !ReadNum(p, e, '\n', num_subtrees)) return false;
+  if (node.entry_count < -1 || num_subtrees < 0 || num_subtrees > e - p) return false;
+  if (node.valid()) {
+    if (e - p < GIT_OID_RAWSZ) return false;
+    std::memcpy(node.oid.id, p, GIT_OID_RAWSZ);
+    p += GIT_OID_RAWSZ;
+  }
+
+  node.subtrees.resize(num_subtrees);
+  for (CacheTree& subtree : node.subtrees) {
+    if (!ReadNode(p, e, depth + 1, subtree) || !subtree.name.len) return false;
+  }
+  auto Lt = [](const CacheTree& x, const CacheTree& y) { return NameLt(x.name, y.name); };
+  if (!std::is_sorted(node.subtrees.begin(), node.subtrees.end(), Lt)) {
+    std::sort(node.subtrees.begin(), node.subtrees.end(), Lt);
+  }
+  return true;
+}
+
+}  // namespace
+
+const CacheTree* CacheTree::Find(StringView name) const {
+  auto it = std::lower_bound(subtrees.begin(), subtrees.end(), name,
+                             [](const CacheTree& x, StringView y) { return NameLt(x.name, y); });
+  if (it == subtrees.end() || it->name.len != name.len ||
+      std::memcmp(it->name.ptr, name.ptr, name.len)) {
+    return nullptr;
+  }
+  return &*it;
+}
+
+bool ParseCacheTree(const char* data, size_t len, CacheTree& root) {
+  const char* p = data;
+  const char* e = data + len;
+  return ReadNode(p, e, 0, root) && !root.name.len && p == e;
+}
+
+}  // namespace gitstatus
@@ -0,0 +1,59 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_CACHE_TREE_H_
+#define ROMKATV_GITSTATUS_CACHE_TREE_H_
+
+#include <git2.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "string_view.h"
+
+namespace gitstatus {
+
+// A node of the cache tree that git stores in the TREE index extension. Each node is a directory
+// in the index; a valid node knows the id of the tree object that its index entries would be
+// written as. Git invalidates nodes on the path to every entry that changes.
+struct CacheTree {
+  // Name of the directory relative to its parent without a trailing slash. Empty for the root.
+  // Points into the index file.
+  StringView name;
+  // The number of index entries under the directory, or -1 if the node is invalid.
+  int64_t entry_count = -1;
+  // Valid only if entry_count >= 0.
+  git_oid oid = {};
+  // In the order used by git: shorter names first, then by memcmp().
+  std::vector<CacheTree> subtrees;
+
+  bool valid() const { return entry_count >= 0; }
+
+  // Returns the subtree with the given name or null.
+  const CacheTree* Find(StringView name) const;
+
+  // Returns true if this node is valid and its tree is `oid`.
+  bool Matches(const git_oid& oid) const { return valid() && git_oid_equal(&this->oid, &oid); }
+};
+
+// Parses the payload of the TREE index extension. Returns false if it's malformed.
+bool ParseCacheTree(const char* data, size_t len, CacheTree& root);
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_CACHE_TREE_H_
@@ -0,0 +1,49 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_CLIENT_H_
+#define ROMKATV_GITSTATUS_CLIENT_H_
+
+#include <unistd.h>
+
+#include "check.h"
+
+namespace gitstatus {
+
+// The sender of requests. Responses are written to its file descriptor.
+//
+// Requests hold shared pointers to their client. If the descriptor is owned, it's closed when
+// the last reference goes away, so a disconnected client's descriptor can't be reused for a
+// new client while some of the old client's requests are still being processed.
+class Client {
+ public:
+  Client(int fd, bool own_fd) : fd_(fd), own_fd_(own_fd) {}
+  Client(Client&&) = delete;
+  ~Client() {
+    if (own_fd_) CHECK(!close(fd_)) << Errno();
+  }
+
+  int fd() const { return fd_; }
+
+ private:
+  int fd_;
+  bool own_fd_;
+};
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_CLIENT_H_
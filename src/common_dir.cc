@@ -0,0 +1,48 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "common_dir.h"
+
+#include "check.h"
+#include "git.h"
+#include "print.h"
+#include "scope_guard.h"
+
+namespace gitstatus {
+
+CommonDir::CommonDir(const char* path) {
+  if (git_repository_open_bare(&repo_, path)) {
+    LOG(ERROR) << "git_repository_open_bare: " << Print(path) << ": " << GitError();
+    throw Exception();
+  }
+  ON_SCOPE_EXIT(&) {
+    if (!tag_db_) {
+      if (odb_) git_odb_free(odb_);
+      git_repository_free(repo_);
+    }
+  };
+  VERIFY(!git_repository_odb(&odb_, repo_)) << GitError();
+  tag_db_ = std::make_unique<TagDb>(repo_);
+}
+
+CommonDir::~CommonDir() {
+  tag_db_.reset();
+  git_odb_free(odb_);
+  git_repository_free(repo_);
+}
+
+}  // namespace gitstatus
@@ -0,0 +1,52 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_COMMON_DIR_H_
+#define ROMKATV_GITSTATUS_COMMON_DIR_H_
+
+#include <memory>
+
+#include <git2.h>
+
+#include "tag_db.h"
+
+namespace gitstatus {
+
+// State shared by all worktrees of the same repository. Everything here is derived from the
+// common git directory: objects, packs and tags.
+class CommonDir {
+ public:
+  // Opens `path` as a bare repository. Throws on error.
+  explicit CommonDir(const char* path);
+  CommonDir(CommonDir&&) = delete;
+  ~CommonDir();
+
+  // Object database of the common dir. Worktrees should adopt it with git_repository_set_odb()
+  // before touching their own so that pack indices are mapped and parsed only once.
+  git_odb* odb() const { return odb_; }
+
+  TagDb& tag_db() { return *tag_db_; }
+
+ private:
+  git_repository* repo_ = nullptr;
+  git_odb* odb_ = nullptr;
+  std::unique_ptr<TagDb> tag_db_;
+};
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_COMMON_DIR_H_
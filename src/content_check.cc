@@ -0,0 +1,110 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "content_check.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "check.h"
+#include "scope_guard.h"
+#include "sha1.h"
+
+namespace gitstatus {
+
+namespace {
+
+// Hashes `size` bytes of `fd` as a blob. Returns false if the file doesn't have exactly `size`
+// bytes, which means it's being modified.
+//
+// The file is read with pread() in fixed-size chunks rather than mapped into memory: if another
+// process truncated a mapped file, accessing the lost pages would kill us with SIGBUS.
+bool HashBlob(int fd, size_t size, git_oid& res) {
+  Sha1 sha;
+  char hdr[32];
+  int n = std::snprintf(hdr, sizeof(hdr), "blob %zu", size);
+  CHECK(n > 0 && n < static_cast<int>(sizeof(hdr)));
+  sha.Update(hdr, n + 1);
+
+  char buf[64 << 10];
+  size_t total = 0;
+  while (true) {
+    ssize_t r = pread(fd, buf, sizeof(buf), total);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) return false;
+    if (r == 0) break;
+    total += r;
+    if (total > size) return false;
+    sha.Update(buf, r);
+  }
+  if (total != size) return false;
+
+  sha.Final(res.id);
+  return true;
+}
+
+}  // namespace
+
+ContentStatus CheckContent(git_repository* repo, const RepoCaps& caps,
+                           const git_index_entry& entry, struct stat& st) {
+  if (GIT_INDEX_ENTRY_STAGE(&entry) || (entry.flags & GIT_INDEX_ENTRY_VALID) ||
+      (entry.flags_extended & (GIT_INDEX_ENTRY_SKIP_WORKTREE | GIT_INDEX_ENTRY_INTENT_TO_ADD)) ||
+      !S_ISREG(entry.mode)) {
+    return ContentStatus::kUnknown;
+  }
+
+  std::string path = git_repository_workdir(repo) + std::string(entry.path);
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0) {
+    return errno == ENOENT || errno == ENOTDIR ? ContentStatus::kDeleted : ContentStatus::kUnknown;
+  }
+  ON_SCOPE_EXIT(&) { CHECK(!close(fd)) << Errno(); };
+
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode)) return ContentStatus::kUnknown;
+  if (caps.trust_filemode && !(st.st_mode & 0100) != !(entry.mode & 0100)) {
+    return ContentStatus::kModified;
+  }
+
+  git_filter_list* filters = nullptr;
+  if (git_filter_list_load(&filters, repo, nullptr, entry.path, GIT_FILTER_TO_ODB,
+                           GIT_FILTER_DEFAULT)) {
+    return ContentStatus::kUnknown;
+  }
+  if (filters) {
+    git_filter_list_free(filters);
+    return ContentStatus::kUnknown;
+  }
+
+  // Index stores the size truncated to 32 bits. Zero size doesn't mean that the file is empty:
+  // git stores it for racily clean entries whose stat it has smudged, and read-tree stores it
+  // for entries that haven't been checked out. Such files have to be hashed.
+  if (entry.file_size && static_cast<uint32_t>(st.st_size) != entry.file_size) {
+    return ContentStatus::kModified;
+  }
+
+  git_oid id;
+  if (!HashBlob(fd, st.st_size, id)) return ContentStatus::kUnknown;
+  return git_oid_equal(&id, &entry.id) ? ContentStatus::kClean : ContentStatus::kModified;
+}
+
+}  // namespace gitstatus
@@ -0,0 +1,51 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_CONTENT_CHECK_H_
+#define ROMKATV_GITSTATUS_CONTENT_CHECK_H_
+
+#include <sys/stat.h>
+
+#include <git2.h>
+
+#include "index.h"
+
+namespace gitstatus {
+
+enum class ContentStatus {
+  // The file in workdir has the same content and mode as the index entry.
+  kClean,
+  kModified,
+  kDeleted,
+  // The file needs filters, isn't a regular file, or the entry has flags that affect the
+  // outcome. Let libgit2 decide.
+  kUnknown,
+};
+
+// Compares the file in workdir with its index entry by hashing its content the way git hashes
+// blobs. Files without clean filters (e.g. no CRLF conversion) hash to the same id as the blob
+// they would be added as, so no filtering is needed.
+//
+// If the result is kClean, `st` is the stat of the file that was read.
+//
+// Thread-safe.
+ContentStatus CheckContent(git_repository* repo, const RepoCaps& caps,
+                           const git_index_entry& entry, struct stat& st);
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_CONTENT_CHECK_H_
@@ -0,0 +1,58 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "ewah.h"
+
+#include "bits.h"
+
+namespace gitstatus {
+
+bool ReadEwah(const char*& p, const char* end, Bitmap& res) {
+  if (end - p < 8) return false;
+  size_t bits = Be32(p);
+  size_t n = Be32(p + 4);
+  if (static_cast<size_t>(end - p - 8) / 8 < n || static_cast<size_t>(end - p - 8) - 8 * n < 4) {
+    return false;
+  }
+  const char* word = p + 8;
+  const char* const words_end = word + 8 * n;
+
+  // The stream consists of marker words, each followed by literal words. A marker says how many
+  // words of all zeros or all ones precede its literals and how many literals follow.
+  res.size_ = bits;
+  res.words_.clear();
+  res.words_.reserve((bits + 63) / 64);
+  while (word != words_end) {
+    uint64_t marker = Be64(word);
+    word += 8;
+    bool fill = marker & 1;
+    size_t fill_len = marker >> 1 & 0xFFFFFFFF;
+    size_t literals = marker >> 33;
+    if (fill_len > res.words_.capacity() - res.words_.size()) return false;
+    res.words_.insert(res.words_.end(), fill_len, fill ? ~uint64_t{0} : 0);
+    if (literals > static_cast<size_t>(words_end - word) / 8) return false;
+    if (literals > res.words_.capacity() - res.words_.size()) return false;
+    for (; literals; --literals, word += 8) res.words_.push_back(Be64(word));
+  }
+  res.words_.resize((bits + 63) / 64);
+  if (bits % 64) res.words_.back() &= (uint64_t{1} << bits % 64) - 1;
+
+  p = words_end + 4;
+  return true;
+}
+
+}  // namespace gitstatus
@@ -0,0 +1,54 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_EWAH_H_
+#define ROMKATV_GITSTATUS_EWAH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace gitstatus {
+
+// Uncompressed bitmap.
+class Bitmap {
+ public:
+  size_t size() const { return size_; }
+  bool operator[](size_t i) const { return i < size_ && words_[i / 64] >> (i % 64) & 1; }
+
+  // Calls f(i) for every set bit in increasing order.
+  template <class F>
+  void ForEach(F f) const {
+    for (size_t w = 0; w != words_.size(); ++w) {
+      for (uint64_t word = words_[w]; word; word &= word - 1) f(w * 64 + __builtin_ctzll(word));
+    }
+  }
+
+ private:
+  friend bool ReadEwah(const char*&, const char*, Bitmap&);
+
+  size_t size_ = 0;
+  std::vector<uint64_t> words_;
+};
+
+// Decodes an EWAH-compressed bitmap as written by git (see ewah/ewah_io.c in git sources) and
+// advances `p` past it. Returns false if the input is malformed.
+bool ReadEwah(const char*& p, const char* end, Bitmap& res);
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_EWAH_H_
@@ -0,0 +1,171 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "fsmonitor.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <utility>
+
+#include "check.h"
+#include "logging.h"
+#include "print.h"
+#include "scope_guard.h"
+
+namespace gitstatus {
+
+namespace {
+
+// Runs `args` in `dir` and returns its stdout. Returns false if the command fails or doesn't
+// finish before the deadline, in which case it gets killed.
+bool Run(const std::vector<std::string>& args, const char* dir, Time deadline, std::string& out) {
+  // Everything the child needs is prepared before fork() because the process is multithreaded.
+  std::vector<char*> argv;
+  for (const std::string& arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+  argv.push_back(nullptr);
+
+  int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (null_fd < 0) return false;
+  ON_SCOPE_EXIT(&) { CHECK(!close(null_fd)) << Errno(); };
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC)) return false;
+  ON_SCOPE_EXIT(&) { CHECK(!close(fds[0])) << Errno(); };
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    LOG(ERROR) << "fork: " << Errno();
+    CHECK(!close(fds[1])) << Errno();
+    return false;
+  }
+  if (pid == 0) {
+    if (chdir(dir) || dup2(null_fd, 0) < 0 || dup2(fds[1], 1) < 0 || dup2(null_fd, 2) < 0) {
+      _exit(127);
+    }
+    execv(argv[0], argv.data());
+    _exit(127);
+  }
+  CHECK(!close(fds[1])) << Errno();
+
+  int status;
+  auto Reap = [&] {
+    while (waitpid(pid, &status, 0) < 0) CHECK(errno == EINTR) << Errno();
+  };
+  bool eof = false;
+  ON_SCOPE_EXIT(&) {
+    if (!eof) {
+      kill(pid, SIGKILL);
+      Reap();
+    }
+  };
+
+  char buf[4096];
+  while (true) {
+    auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+    if (timeout.count() <= 0) {
+      LOG(INFO) << "Deadline exceeded while waiting for: " << Print(args);
+      return false;
+    }
+    pollfd pfd = {.fd = fds[0], .events = POLLIN};
+    int n = poll(&pfd, 1, std::min<int64_t>(timeout.count(), 1 << 30));
+    if (n < 0 && errno == EINTR) continue;
+    CHECK(n >= 0) << Errno();
+    if (n == 0) continue;
+    ssize_t r = read(fds[0], buf, sizeof(buf));
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) return false;
+    if (r == 0) break;
+    out.append(buf, r);
+  }
+
+  eof = true;
+  Reap();
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    LOG(WARN) << "Command failed: " << Print(args);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+FsmonitorChanges::FsmonitorChanges(std::vector<std::string> paths) : paths_(std::move(paths)) {
+  for (std::string& path : paths_) {
+    while (!path.empty() && path.back() == '/') path.pop_back();
+  }
+  std::sort(paths_.begin(), paths_.end());
+  paths_.erase(std::unique(paths_.begin(), paths_.end()), paths_.end());
+}
+
+bool FsmonitorChanges::MayHaveChanged(StringView path) const {
+  auto Listed = [&](size_t len) {
+    return std::binary_search(paths_.begin(), paths_.end(), StringView(path.ptr, len),
+                              [](StringView x, StringView y) {
+                                int cmp = std::memcmp(x.ptr, y.ptr, std::min(x.len, y.len));
+                                return cmp ? cmp < 0 : x.len < y.len;
+                              });
+  };
+  for (size_t i = 0; i != path.len; ++i) {
+    if (path.ptr[i] == '/' && Listed(i)) return true;
+  }
+  return Listed(path.len);
+}
+
+std::shared_ptr<const FsmonitorChanges> QueryFsmonitor(const std::string& hook, const char* workdir,
+                                                       unsigned version, const std::string& token,
+                                                       Time deadline) {
+  if (version != 1 && version != 2) return nullptr;
+  // The same command line as git's: the hook is run by the shell with version and token as
+  // arguments, in the root of the worktree.
+  std::vector<std::string> args = {"/bin/sh", "-c", hook + " \"$@\"", hook,
+                                   std::to_string(version), token};
+  std::string out;
+  if (!Run(args, workdir, deadline, out)) return nullptr;
+
+  // The output is a list of NUL-terminated paths. Version 2 starts with the new token.
+  std::vector<std::string> paths;
+  size_t pos = 0;
+  if (version == 2) {
+    pos = out.find('\0');
+    if (pos == std::string::npos) return nullptr;
+    ++pos;
+  }
+  while (pos < out.size()) {
+    size_t end = out.find('\0', pos);
+    if (end == std::string::npos) end = out.size();
+    if (end != pos) {
+      // A lone slash means that the hook couldn't tell what has changed.
+      if (out.compare(pos, end - pos, "/") == 0) return nullptr;
+      paths.emplace_back(out, pos, end - pos);
+    }
+    pos = end + 1;
+  }
+
+  LOG(INFO) << "fsmonitor reported " << paths.size() << " changed path(s)";
+  return std::make_shared<const FsmonitorChanges>(std::move(paths));
+}
+
+}  // namespace gitstatus
@@ -0,0 +1,54 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_FSMONITOR_H_
+#define ROMKATV_GITSTATUS_FSMONITOR_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "string_view.h"
+#include "time.h"
+
+namespace gitstatus {
+
+// Paths reported by an fsmonitor hook as possibly changed since a given token.
+class FsmonitorChanges {
+ public:
+  // `paths` are relative to workdir. Directories may or may not have a trailing slash.
+  explicit FsmonitorChanges(std::vector<std::string> paths);
+
+  // Returns true if `path` or any of its parent directories has been reported as changed.
+  bool MayHaveChanged(StringView path) const;
+
+  size_t size() const { return paths_.size(); }
+
+ private:
+  std::vector<std::string> paths_;
+};
+
+// Runs the fsmonitor hook (the value of core.fsmonitor) the way git does and returns the paths
+// that it reports as changed since `token`. Returns null if the hook fails, doesn't finish before
+// the deadline, or reports that everything may have changed.
+std::shared_ptr<const FsmonitorChanges> QueryFsmonitor(const std::string& hook, const char* workdir,
+                                                       unsigned version, const std::string& token,
+                                                       Time deadline);
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_FSMONITOR_H_
@@ -107,17 +107,22 @@ std::string RepoState(git_repository* repo) {
   return res.str();
 }
 
-size_t CountRange(git_repository* repo, const std::string& range) {
+ssize_t CountRange(git_repository* repo, const std::string& range, Time deadline) {
+  // Checking the clock on every commit would be wasteful.
+  constexpr ssize_t kCommitsPerClockCheck = 256;
   git_revwalk* walk = nullptr;
   VERIFY(!git_revwalk_new(&walk, repo)) << GitError();
   ON_SCOPE_EXIT(=) { git_revwalk_free(walk); };
   VERIFY(!git_revwalk_push_range(walk, range.c_str())) << GitError();
-  size_t res = 0;
+  ssize_t res = 0;
   while (true) {
     git_oid oid;
     switch (git_revwalk_next(&oid, walk)) {
       case 0:
-        ++res;
+        if (++res % kCommitsPerClockCheck == 0 && Clock::now() >= deadline) {
+          LOG(INFO) << "Deadline exceeded while counting commits in " << range;
+          return -1;
+        }
         break;
       case GIT_ITEROVER:
         return res;
@@ -128,6 +133,17 @@ size_t CountRange(git_repository* repo, const std::string& range) {
   }
 }
 
+std::string ExcludesFile(git_config* cfg) {
+  git_buf buf = {};
+  ON_SCOPE_EXIT(&) { git_buf_free(&buf); };
+  if (!git_config_get_path(&buf, cfg, "core.excludesfile")) return std::string(buf.ptr, buf.size);
+  const char* xdg = std::getenv("XDG_CONFIG_HOME");
+  if (xdg && *xdg) return std::string(xdg) + "/git/ignore";
+  const char* home = std::getenv("HOME");
+  if (home && *home) return std::string(home) + "/.config/git/ignore";
+  return "";
+}
+
 size_t NumStashes(git_repository* repo) {
   size_t res = 0;
   auto* cb = +[](size_t index, const char* message, const git_oid* stash_id, void* payload) {
@@ -20,10 +20,14 @@
 
 #include <git2.h>
 
+#include <sys/types.h>
+
 #include <cstddef>
 #include <memory>
 #include <string>
 
+#include "time.h"
+
 namespace gitstatus {
 
 // Not null.
@@ -32,8 +36,11 @@ const char* GitError();
 // Not null.
 std::string RepoState(git_repository* repo);
 
-// Returns the number of commits in the range.
-size_t CountRange(git_repository* repo, const std::string& range);
+// Returns the number of commits in the range or -1 if the deadline passes before the walk is done.
+ssize_t CountRange(git_repository* repo, const std::string& range, Time deadline = Time::max());
+
+// Returns the path to the global exclude file: core.excludesFile or its default. Can be empty.
+std::string ExcludesFile(git_config* cfg);
 
 // How many stashes are there?
 size_t NumStashes(git_repository* repo);
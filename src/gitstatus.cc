@@ -18,8 +18,11 @@
 #include <time.h>
 
 #include <cstddef>
+#include <cstdlib>
 #include <future>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <git2.h>
 
@@ -33,6 +36,8 @@
 #include "request.h"
 #include "response.h"
 #include "scope_guard.h"
+#include "socket_server.h"
+#include "submodules.h"
 #include "thread_pool.h"
 #include "timer.h"
 
@@ -49,7 +54,9 @@ void ProcessRequest(const Options& opts, RepoCache& cache, Request req) {
   Timer timer;
   ON_SCOPE_EXIT(&) { timer.Report("request"); };
 
-  ResponseWriter resp(req.id);
+  ResponseWriter resp(req.client->fd(), req.id, req.cancel);
+  if (req.cancel.Cancelled()) return;
+
   Repo* repo = cache.Open(req.dir, req.from_dotgit);
   if (!repo) return;
 
@@ -69,7 +76,7 @@ void ProcessRequest(const Options& opts, RepoCache& cache, Request req) {
   // Looking up tags may take some time. Do it in the background while we check for stuff.
   // Note that GetTagName() doesn't access index, so it'll overlap with index reading and
   // parsing.
-  std::future<std::string> tag = repo->GetTagName(head_target);
+  std::future<TagName> tag = repo->GetTagName(head_target, req.deadline);
   ON_SCOPE_EXIT(&) {
     if (tag.valid()) {
       try {
@@ -106,27 +113,47 @@ void ProcessRequest(const Options& opts, RepoCache& cache, Request req) {
   // Repository state, A.K.A. action. For example, "merge".
   resp.Print(RepoState(repo->repo()));
 
+  // Everything above is cheap. Let the client render it while we are scanning the index.
+  if (req.stream) resp.DumpPartial("with HEAD-derived fields");
+
   IndexStats stats;
   // Look for staged, unstaged and untracked. This is where most of the time is spent.
-  if (req.diff) stats = repo->GetIndexStats(head_target, cfg);
+  if (req.diff) stats = repo->GetIndexStats(head_target, cfg, req.deadline, req.cancel);
+  // There is a newer request from the same session. Don't bother finishing this one.
+  if (req.cancel.Cancelled()) return;
+
+  // Set to true when any field is printed as -1 because the deadline passed.
+  bool incomplete = false;
+  auto Known = [&](bool complete, ssize_t val) -> ssize_t {
+    if (complete) return val;
+    incomplete = true;
+    return -1;
+  };
+  auto Staged = [&](size_t val) { return Known(stats.staged_complete, val); };
+  auto Dirty = [&](size_t val) { return Known(stats.dirty_complete, val); };
+  auto Range = [&](const char* from, const char* to) {
+    ssize_t res = CountRange(repo->repo(), from + ".."s + to, req.deadline);
+    if (res < 0) incomplete = true;
+    return res;
+  };
 
   // The number of files in the index.
   resp.Print(stats.index_size);
   // The number of staged changes. At most opts.max_num_staged.
-  resp.Print(stats.num_staged);
+  resp.Print(Staged(stats.num_staged));
   // The number of unstaged changes. At most opts.max_num_unstaged. 0 if index is too large.
-  resp.Print(stats.num_unstaged);
+  resp.Print(Dirty(stats.num_unstaged));
   // The number of conflicted changes. At most opts.max_num_conflicted. 0 if index is too large.
-  resp.Print(stats.num_conflicted);
+  resp.Print(Staged(stats.num_conflicted));
   // The number of untracked changes. At most opts.max_num_untracked. 0 if index is too large.
-  resp.Print(stats.num_untracked);
+  resp.Print(Dirty(stats.num_untracked));
 
   if (remote && remote->ref) {
     const char* ref = git_reference_name(remote->ref);
-    // Number of commits we are ahead of upstream. Non-negative integer.
-    resp.Print(CountRange(repo->repo(), ref + "..HEAD"s));
-    // Number of commits we are behind upstream. Non-negative integer.
-    resp.Print(CountRange(repo->repo(), "HEAD.."s + ref));
+    // Number of commits we are ahead of upstream. Non-negative integer or -1 if unknown.
+    resp.Print(Range(ref, "HEAD"));
+    // Number of commits we are behind upstream. Non-negative integer or -1 if unknown.
+    resp.Print(Range("HEAD", ref));
   } else {
     resp.Print("0");
     resp.Print("0");
@@ -137,14 +164,17 @@ void ProcessRequest(const Options& opts, RepoCache& cache, Request req) {
 
   // Tag that points to HEAD (e.g., "v4.2") or empty string if there aren't any. The same as
   // `git describe --tags --exact-match`.
-  resp.Print(tag.get());
+  // Empty if the deadline passed before all tags were checked.
+  TagName tag_name = tag.get();
+  if (!tag_name.complete) incomplete = true;
+  resp.Print(tag_name.name);
 
   // The number of unstaged deleted files. At most stats.num_unstaged.
-  resp.Print(stats.num_unstaged_deleted);
+  resp.Print(Dirty(stats.num_unstaged_deleted));
   // The number of staged new files. At most stats.num_staged.
-  resp.Print(stats.num_staged_new);
+  resp.Print(Staged(stats.num_staged_new));
   // The number of staged deleted files. At most stats.num_staged.
-  resp.Print(stats.num_staged_deleted);
+  resp.Print(Staged(stats.num_staged_deleted));
 
   // Push remote or null.
   PushRemotePtr push_remote = GetPushRemote(repo->repo(), head);
@@ -157,35 +187,65 @@ void ProcessRequest(const Options& opts, RepoCache& cache, Request req) {
 
   if (push_remote && push_remote->ref) {
     const char* ref = git_reference_name(push_remote->ref);
-    // Number of commits we are ahead of push remote. Non-negative integer.
-    resp.Print(CountRange(repo->repo(), ref + "..HEAD"s));
-    // Number of commits we are behind upstream. Non-negative integer.
-    resp.Print(CountRange(repo->repo(), "HEAD.."s + ref));
+    // Number of commits we are ahead of push remote. Non-negative integer or -1 if unknown.
+    resp.Print(Range(ref, "HEAD"));
+    // Number of commits we are behind upstream. Non-negative integer or -1 if unknown.
+    resp.Print(Range("HEAD", ref));
   } else {
     resp.Print("0");
     resp.Print("0");
   }
 
   // The number of files in the index with skip-worktree bit set.
-  resp.Print(stats.num_skip_worktree);
+  resp.Print(Staged(stats.num_skip_worktree));
   // The number of files in the index with assume-unchanged bit set.
-  resp.Print(stats.num_assume_unchanged);
+  resp.Print(Staged(stats.num_assume_unchanged));
 
   CommitMessage msg = head_target ? GetCommitMessage(repo->repo(), *head_target) : CommitMessage();
   Truncate(msg.summary, opts.max_commit_summary_length);
   resp.Print(msg.encoding);
   resp.Print(msg.summary);
 
+  if (opts.recurse_submodules) {
+    SubmoduleStats sub;
+    if (req.diff) sub = GetSubmoduleStats(cache, *repo, cfg, req.deadline, req.cancel);
+    if (req.cancel.Cancelled()) return;
+    auto Submodules = [&](size_t val) { return Known(sub.complete, val); };
+    // The number of submodules with staged, unstaged or conflicted changes.
+    resp.Print(Submodules(sub.num_modified));
+    // The number of submodules with untracked files.
+    resp.Print(Submodules(sub.num_untracked));
+  }
+
+  // 1 if some fields are unknown because the deadline passed, 0 otherwise. Only present when
+  // the request has a time budget, so that responses to old-style requests don't change.
+  if (req.deadline != Time::max()) resp.Print(incomplete);
+
   resp.Dump("with git status");
 }
 
+// Source is either RequestReader or SocketServer. Returns on EOF.
+template <class Source>
+void ReadRequests(Source& source, RequestQueue& queue) {
+  std::vector<Request> reqs;
+  while (true) {
+    try {
+      reqs.clear();
+      bool eof = !source.ReadRequests(reqs);
+      for (Request& req : reqs) queue.Push(std::move(req));
+      if (eof) return;
+    } catch (const Exception&) {
+    }
+  }
+}
+
 int GitStatus(int argc, char** argv) {
   tzset();
   Options opts = ParseOptions(argc, argv);
   g_min_log_level = opts.log_level;
   for (int i = 0; i != argc; ++i) LOG(INFO) << "argv[" << i << "]: " << Print(argv[i]);
-  RequestReader reader(fileno(stdin), opts.lock_fd, opts.parent_pid);
-  RepoCache cache(opts);
+  RequestQueue queue;
+  RepoCache cache(opts, opts.max_cache_bytes);
 
   InitGlobalThreadPool(opts.num_threads);
   git_libgit2_opts(GIT_OPT_ENABLE_STRICT_HASH_VERIFICATION, 0);
@@ -194,23 +254,54 @@ int GitStatus(int argc, char** argv) {
   git_libgit2_opts(GIT_OPT_DISABLE_READNG_PACKED_TAGS, 1);
   git_libgit2_init();
 
-  while (true) {
-    try {
-      Request req;
-      if (reader.ReadRequest(req)) {
-        LOG(INFO) << "Processing request: " << req;
-        try {
-          ProcessRequest(opts, cache, req);
-          LOG(INFO) << "Successfully processed request: " << req;
-        } catch (const Exception&) {
-          LOG(ERROR) << "Error processing request: " << req;
+  // Requests are processed on a separate thread so that we can keep reading them. This is
+  // what allows a newer request to cancel an older one from the same session.
+  std::thread worker([&] {
+    while (true) {
+      try {
+        // Sleep until there is a request or until it's time to close the least recently used
+        // repo. An idle daemon with an empty cache doesn't wake up at all.
+        Time deadline = Time::max();
+        if (opts.repo_ttl >= Duration() && cache.OldestUse() != Time::max()) {
+          deadline = cache.OldestUse() + opts.repo_ttl;
+        }
+        Request req;
+        if (queue.Pop(deadline, req)) {
+          LOG(INFO) << "Processing request: " << req;
+          try {
+            ProcessRequest(opts, cache, req);
+            if (req.cancel.Cancelled()) {
+              LOG(INFO) << "Cancelled request: " << req;
+            } else {
+              LOG(INFO) << "Successfully processed request: " << req;
+            }
+          } catch (const Exception&) {
+            LOG(ERROR) << "Error processing request: " << req;
+          }
+          cache.Trim();
+        } else if (queue.Drained()) {
+          return;
+        } else {
+          cache.Free(Clock::now() - opts.repo_ttl);
         }
-      } else if (opts.repo_ttl >= Duration()) {
-        cache.Free(Clock::now() - opts.repo_ttl);
+      } catch (const Exception&) {
       }
-    } catch (const Exception&) {
     }
+  });
+
+  if (opts.socket.empty()) {
+    RequestReader reader(fileno(stdin), opts.lock_fd, opts.parent_pid);
+    ReadRequests(reader, queue);
+  } else {
+    SocketServer server(opts.socket, opts.lock_fd, opts.parent_pid);
+    ReadRequests(server, queue);
   }
+
+  // Reply to the requests that have already been read before exiting.
+  queue.Close();
+  worker.join();
+  LOG(INFO) << "EOF. Exiting.";
+  std::exit(0);
 }
 
 }  // namespace
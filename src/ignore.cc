@@ -0,0 +1,370 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "ignore.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <utility>
+
+#include "git.h"
+#include "logging.h"
+#include "print.h"
+#include "stat.h"
+
+namespace gitstatus {
+
+namespace {
+
+enum WildResult { kMatch, kNoMatch, kAbortAll, kAbortToStarStar };
+
+// Returns kTrue or kFalse depending on whether `c` belongs to the named character class such as
+// "alpha", or kUnknown if there is no such class.
+Tribool InClass(const std::string& name, unsigned char c) {
+  static const std::pair<const char*, int (*)(int)> kClasses[] = {
+      {"alnum", std::isalnum}, {"alpha", std::isalpha}, {"blank", std::isblank},
+      {"cntrl", std::iscntrl}, {"digit", std::isdigit}, {"graph", std::isgraph},
+      {"lower", std::islower}, {"print", std::isprint}, {"punct", std::ispunct},
+      {"space", std::isspace}, {"upper", std::isupper}, {"xdigit", std::isxdigit}};
+  for (const auto& cls : kClasses) {
+    if (name == cls.first) return cls.second(c) ? Tribool::kTrue : Tribool::kFalse;
+  }
+  return Tribool::kUnknown;
+}
+
+// The same algorithm as wildmatch() with WM_PATHNAME in git sources: `*` and `?` don't match
+// slashes while `**` between slashes matches any number of directories.
+WildResult Wild(const char* p, const char* text) {
+  const char* const pattern = p;
+  for (; *p; ++text, ++p) {
+    unsigned char t = *text;
+    unsigned char c = *p;
+    if (!t && c != '*') return kAbortAll;
+    switch (c) {
+      case '\\':
+        c = *++p;
+        // fallthrough
+      default:
+        if (t != c) return kNoMatch;
+        continue;
+      case '?':
+        if (t == '/') return kNoMatch;
+        continue;
+      case '*': {
+        bool match_slash = false;
+        if (*++p == '*') {
+          const char* prev = p - 2;
+          while (*++p == '*') {
+          }
+          if ((prev < pattern || *prev == '/') &&
+              (!*p || *p == '/' || (p[0] == '\\' && p[1] == '/'))) {
+            if (*p == '/' && Wild(p + 1, text) == kMatch) return kMatch;
+            match_slash = true;
+          }
+        }
+        if (!*p) {
+          // Trailing `**` matches everything. Trailing `*` matches only if there are no more
+          // slashes.
+          return match_slash || !std::strchr(text, '/') ? kMatch : kNoMatch;
+        }
+        if (!match_slash && *p == '/') {
+          // `*/` matches the rest of the current path component. The slash is consumed by the
+          // outer loop.
+          const char* slash = std::strchr(text, '/');
+          if (!slash) return kNoMatch;
+          text = slash;
+          break;
+        }
+        for (; t; t = *++text) {
+          WildResult res = Wild(p, text);
+          if (res != kNoMatch) {
+            if (!match_slash || res != kAbortToStarStar) return res;
+          } else if (!match_slash && t == '/') {
+            return kAbortToStarStar;
+          }
+        }
+        return kAbortAll;
+      }
+      case '[': {
+        c = *++p;
+        if (c == '^') c = '!';
+        const bool negated = c == '!';
+        if (negated) c = *++p;
+        unsigned char prev = 0;
+        bool matched = false;
+        do {
+          if (!c) return kAbortAll;
+          if (c == '\\') {
+            c = *++p;
+            if (!c) return kAbortAll;
+            if (t == c) matched = true;
+          } else if (c == '-' && prev && p[1] && p[1] != ']') {
+            c = *++p;
+            if (c == '\\') {
+              c = *++p;
+              if (!c) return kAbortAll;
+            }
+            if (t <= c && t >= prev) matched = true;
+            c = 0;
+          } else if (c == '[' && p[1] == ':') {
+            const char* s = p += 2;
+            while (*p && *p != ']') ++p;
+            if (!*p) return kAbortAll;
+            if (p - s < 1 || p[-1] != ':') {
+              // Not a character class after all.
+              p = s - 2;
+              c = '[';
+              if (t == c) matched = true;
+              continue;
+            }
+            switch (InClass(std::string(s, p - 1), t)) {
+              case Tribool::kTrue:
+                matched = true;
+                break;
+              case Tribool::kFalse:
+                break;
+              case Tribool::kUnknown:
+                return kAbortAll;
+            }
+            c = 0;
+          } else if (t == c) {
+            matched = true;
+          }
+        } while (prev = c, (c = *++p) != ']');
+        if (matched == negated || t == '/') return kNoMatch;
+        continue;
+      }
+    }
+  }
+  return *text ? kNoMatch : kMatch;
+}
+
+bool Wildmatch(const char* pattern, const char* text) { return Wild(pattern, text) == kMatch; }
+
+bool HasWildcards(const std::string& s) { return s.find_first_of("*?[\\") != std::string::npos; }
+
+void Fold(std::string& s) {
+  for (char& c : s) c = std::tolower(static_cast<unsigned char>(c));
+}
+
+}  // namespace
+
+IgnoreRules::IgnoreRules(const std::string& content, bool case_sensitive)
+    : case_sensitive_(case_sensitive) {
+  for (size_t pos = 0; pos < content.size();) {
+    size_t eol = std::min(content.find('\n', pos), content.size());
+    std::string line = content.substr(pos, eol - pos);
+    pos = eol + 1;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty() || line.front() == '#') continue;
+    // Trailing spaces are ignored unless escaped with a backslash.
+    while (line.size() && line.back() == ' ' &&
+           !(line.size() > 1 && line[line.size() - 2] == '\\')) {
+      line.pop_back();
+    }
+    const bool negated = !line.empty() && line.front() == '!';
+    if (negated) line.erase(0, 1);
+    const bool dir_only = !line.empty() && line.back() == '/';
+    if (dir_only) line.pop_back();
+    if (line.empty()) continue;
+    if (!case_sensitive_) Fold(line);
+    Add(std::move(line), negated, dir_only);
+  }
+}
+
+void IgnoreRules::Add(std::string pattern, bool negated, bool dir_only) {
+  const int idx = negated_.size();
+  negated_.push_back(negated);
+  auto Update = [&](Last& last) { (dir_only ? last.dir : last.any) = idx; };
+
+  // A slash anywhere but at the end anchors the pattern to the directory of the gitignore file.
+  // Otherwise it's matched against basenames at any depth.
+  const bool anchored = pattern.find('/') != std::string::npos;
+  if (pattern.front() == '/') pattern.erase(0, 1);
+
+  if (!HasWildcards(pattern)) {
+    Update((anchored ? paths_ : basenames_)[pattern]);
+    return;
+  }
+
+  if (!anchored && pattern.front() == '*' && !HasWildcards(pattern.substr(1))) {
+    std::string suffix = pattern.substr(1);
+    if (std::find(suffix_lens_.begin(), suffix_lens_.end(), suffix.size()) ==
+        suffix_lens_.end()) {
+      suffix_lens_.push_back(suffix.size());
+    }
+    Update(suffixes_[suffix]);
+    return;
+  }
+
+  Glob glob = {.idx = idx, .dir_only = dir_only, .basename = !anchored};
+  // Stop at a slash because `**/` can match nothing.
+  glob.tail = pattern.substr(pattern.find_last_of("*?[]\\/") + 1);
+  glob.pattern = std::move(pattern);
+  globs_.push_back(std::move(glob));
+}
+
+Tribool IgnoreRules::Match(const char* path, bool is_dir) const {
+  std::string folded;
+  if (!case_sensitive_) {
+    folded = path;
+    Fold(folded);
+    path = folded.c_str();
+  }
+  const size_t path_len = std::strlen(path);
+  const char* slash = std::strrchr(path, '/');
+  const char* base = slash ? slash + 1 : path;
+  const size_t base_len = path + path_len - base;
+
+  int best = -1;
+  auto Find = [&](const std::unordered_map<std::string, Last>& rules, const char* s, size_t n) {
+    if (rules.empty()) return;
+    auto it = rules.find(std::string(s, n));
+    if (it == rules.end()) return;
+    best = std::max(best, it->second.any);
+    if (is_dir) best = std::max(best, it->second.dir);
+  };
+  Find(basenames_, base, base_len);
+  Find(paths_, path, path_len);
+  for (size_t len : suffix_lens_) {
+    if (len <= base_len) Find(suffixes_, base + base_len - len, len);
+  }
+
+  // The last matching rule wins, so globs before `best` don't matter.
+  for (auto it = globs_.rbegin(); it != globs_.rend() && it->idx > best; ++it) {
+    if (it->dir_only && !is_dir) continue;
+    const char* s = it->basename ? base : path;
+    const size_t n = it->basename ? base_len : path_len;
+    const std::string& tail = it->tail;
+    if (tail.size() > n || std::memcmp(s + n - tail.size(), tail.data(), tail.size())) continue;
+    if (Wildmatch(it->pattern.c_str(), s)) {
+      best = it->idx;
+      break;
+    }
+  }
+
+  if (best < 0) return Tribool::kUnknown;
+  return negated_[best] ? Tribool::kFalse : Tribool::kTrue;
+}
+
+size_t IgnoreRules::MemoryUsage() const {
+  size_t res = negated_.capacity() / 8 + suffix_lens_.capacity() * sizeof(size_t) +
+               globs_.capacity() * sizeof(Glob);
+  for (const auto* rules : {&basenames_, &paths_, &suffixes_}) {
+    res += rules->bucket_count() * sizeof(void*);
+    for (const auto& kv : *rules) res += sizeof(kv) + 2 * sizeof(void*) + kv.first.capacity();
+  }
+  for (const Glob& glob : globs_) res += glob.pattern.capacity() + glob.tail.capacity();
+  return res;
+}
+
+void IgnoreCache::Refresh(git_repository* repo, git_config* cfg) {
+  int ignore_case;
+  if (git_config_get_bool(&ignore_case, cfg, "core.ignorecase")) ignore_case = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (case_sensitive_ != !ignore_case) {
+    case_sensitive_ = !ignore_case;
+    files_.clear();
+  }
+  workdir_ = git_repository_workdir(repo);
+  global_ = {git_repository_commondir(repo) + std::string("info/exclude"), ExcludesFile(cfg)};
+  ++generation_;
+}
+
+bool IgnoreCache::Ignored(StringView path) {
+  std::string p(path.ptr, path.len);
+  const bool is_dir = !p.empty() && p.back() == '/';
+  if (is_dir) p.pop_back();
+  if (p.empty()) return false;
+  // Git doesn't look inside ignored directories, so their contents can't be re-included.
+  for (size_t i = p.find('/'); i != std::string::npos; i = p.find('/', i + 1)) {
+    if (Match(p.substr(0, i), true) == Tribool::kTrue) return true;
+  }
+  return Match(p, is_dir) == Tribool::kTrue;
+}
+
+Tribool IgnoreCache::Match(const std::string& path, bool is_dir) {
+  // The nearest .gitignore with a matching pattern decides.
+  for (size_t i = path.size(); i--;) {
+    if (i && path[i - 1] != '/') continue;
+    std::shared_ptr<const IgnoreRules> rules = Get(workdir_ + path.substr(0, i) + ".gitignore");
+    if (!rules) continue;
+    Tribool res = rules->Match(path.c_str() + i, is_dir);
+    if (res != Tribool::kUnknown) return res;
+  }
+  for (const std::string& file : global_) {
+    if (file.empty()) continue;
+    std::shared_ptr<const IgnoreRules> rules = Get(file);
+    if (!rules) continue;
+    Tribool res = rules->Match(path.c_str(), is_dir);
+    if (res != Tribool::kUnknown) return res;
+  }
+  return Tribool::kUnknown;
+}
+
+std::shared_ptr<const IgnoreRules> IgnoreCache::Get(const std::string& path) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = files_.find(path);
+    if (it != files_.end() && it->second.generation == generation_) return it->second.rules;
+  }
+
+  struct stat st;
+  if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode)) st = {};
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = files_.find(path);
+    if (it != files_.end() && StatEq(it->second.st, st)) {
+      it->second.generation = generation_;
+      return it->second.rules;
+    }
+  }
+
+  std::shared_ptr<const IgnoreRules> rules;
+  if (st.st_mode) {
+    time_t now = std::time(nullptr);
+    std::ifstream strm(path);
+    std::string content((std::istreambuf_iterator<char>(strm)), std::istreambuf_iterator<char>());
+    auto compiled = std::make_shared<IgnoreRules>(content, case_sensitive_);
+    LOG(DEBUG) << "Compiled " << compiled->size() << " ignore pattern(s) from " << Print(path);
+    if (compiled->size()) rules = std::move(compiled);
+    // With one-second timestamp granularity, a file modified in the same second as it was read
+    // could be modified again without changing its stat. Re-read it next time.
+    if (MTim(st).tv_sec >= now) st.st_mode = 0;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  files_[path] = File{.st = st, .generation = generation_, .rules = rules};
+  return rules;
+}
+
+size_t IgnoreCache::MemoryUsage() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  size_t res = files_.bucket_count() * sizeof(void*);
+  for (const auto& kv : files_) {
+    res += sizeof(kv) + 2 * sizeof(void*) + kv.first.capacity();
+    if (kv.second.rules) res += sizeof(IgnoreRules) + kv.second.rules->MemoryUsage();
+  }
+  return res;
+}
+
+}  // namespace gitstatus
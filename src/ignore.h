@@ -0,0 +1,129 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_IGNORE_H_
+#define ROMKATV_GITSTATUS_IGNORE_H_
+
+#include <sys/stat.h>
+
+#include <git2.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "string_view.h"
+#include "tribool.h"
+
+namespace gitstatus {
+
+// Patterns from a single gitignore file, compiled for matching many paths. Literal patterns and
+// patterns of the form `*suffix` (e.g. `*.o`) are looked up in hash tables; the rest are matched
+// with wildmatch semantics, with a literal tail used to reject most paths without matching.
+//
+// Immutable and thus thread-safe.
+class IgnoreRules {
+ public:
+  IgnoreRules(const std::string& content, bool case_sensitive);
+
+  // Returns kTrue if the last pattern matching `path` excludes it, kFalse if it re-includes it
+  // (`!pattern`) and kUnknown if no pattern matches. `path` is relative to the directory of the
+  // gitignore file and doesn't have a trailing slash.
+  Tribool Match(const char* path, bool is_dir) const;
+
+  size_t size() const { return negated_.size(); }
+
+  size_t MemoryUsage() const;
+
+ private:
+  // Indices of the last matching rules. Rules with a trailing slash match only directories.
+  struct Last {
+    int any = -1;
+    int dir = -1;
+  };
+
+  struct Glob {
+    int idx;
+    bool dir_only;
+    // If true, matched against the basename; otherwise against the whole path.
+    bool basename;
+    std::string pattern;
+    // Matching paths end with this.
+    std::string tail;
+  };
+
+  void Add(std::string pattern, bool negated, bool dir_only);
+
+  const bool case_sensitive_;
+  std::vector<bool> negated_;
+  // Patterns without wildcards, matched against basenames and full paths respectively.
+  std::unordered_map<std::string, Last> basenames_;
+  std::unordered_map<std::string, Last> paths_;
+  // Patterns `*suffix` where `suffix` has no wildcards or slashes. Keys are suffixes.
+  std::unordered_map<std::string, Last> suffixes_;
+  // Distinct lengths of keys in `suffixes_`.
+  std::vector<size_t> suffix_lens_;
+  // Ordered by index.
+  std::vector<Glob> globs_;
+};
+
+// Decides whether untracked files are ignored the way git does: per-directory .gitignore files
+// take precedence over info/exclude, which takes precedence over core.excludesFile; the contents
+// of an ignored directory are ignored. Compiled gitignore files are cached until their stat
+// changes.
+//
+// Thread-safe.
+class IgnoreCache {
+ public:
+  // Must be called before Ignored() and whenever ignore files or git config may have changed.
+  // Between calls every ignore file is stat'ed at most once. Must not be called concurrently
+  // with Ignored().
+  void Refresh(git_repository* repo, git_config* cfg);
+
+  // Returns true if the untracked `path` is ignored. `path` is relative to workdir and must have
+  // a trailing slash if it's a directory.
+  bool Ignored(StringView path);
+
+  size_t MemoryUsage() const;
+
+ private:
+  struct File {
+    struct stat st;
+    uint64_t generation;
+    std::shared_ptr<const IgnoreRules> rules;
+  };
+
+  // Returns null if the file doesn't exist or has no patterns.
+  std::shared_ptr<const IgnoreRules> Get(const std::string& path);
+  Tribool Match(const std::string& path, bool is_dir);
+
+  mutable std::mutex mutex_;
+  uint64_t generation_ = 0;
+  bool case_sensitive_ = true;
+  std::string workdir_;
+  // info/exclude and core.excludesFile, in this order.
+  std::vector<std::string> global_;
+  std::unordered_map<std::string, File> files_;
+};
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_IGNORE_H_
@@ -58,6 +58,13 @@ void CommonDir(Str<> str, const char* a, const char* b, size_t* dir_len, size_t*
 
 size_t Weight(const IndexDir& dir) { return 1 + dir.subdirs.size() + dir.files.size(); }
 
+// FNV-1a with a terminating zero byte so that ("ab", "c") and ("a", "bc") hash differently.
+uint64_t Hash(uint64_t h, const char* s, size_t len) {
+  constexpr uint64_t kPrime = 1099511628211u;
+  for (size_t i = 0; i != len; ++i) h = (h ^ static_cast<unsigned char>(s[i])) * kPrime;
+  return h * kPrime;
+}
+
 bool MTimeEq(const git_index_time& index, const struct timespec& workdir) {
   if (index.seconds != workdir.tv_sec) return false;
   if (int64_t{index.nanoseconds} == workdir.tv_nsec) return true;
@@ -142,9 +149,22 @@ void OpenTail(int* fds, size_t nfds, int root_fd, StringView dirname, Arena& are
   }
 }
 
-std::vector<const char*> ScanDirs(git_index* index, int root_fd, IndexDir* const* begin,
-                                  IndexDir* const* end, const RepoCaps& caps,
-                                  const ScanOpts& opts) {
+// Like StatEq() but also handles stats seeded from git's untracked cache. The latter have zero
+// st_mode and only 32 bits of st_ino and st_size.
+bool DirStatEq(const struct stat& cur, const struct stat& cached) {
+  if (cached.st_mode) return StatEq(cur, cached);
+  return MTim(cur).tv_sec == MTim(cached).tv_sec && MTim(cur).tv_nsec == MTim(cached).tv_nsec &&
+         static_cast<uint32_t>(cur.st_ino) == cached.st_ino &&
+         static_cast<uint32_t>(cur.st_size) == cached.st_size;
+}
+
+void ScanDirs(int root_fd, IndexDir* const* begin, IndexDir* const* end, const RepoCaps& caps,
+              const ScanOpts& opts, const IndexFile* index_file) {
+  // Candidates are handed over in batches of at least this size so that they can be verified
+  // while the rest of the shard is being scanned. Batches end on directory boundaries, which
+  // guarantees that they don't overlap.
+  constexpr size_t kMinBatchSize = 64;
+
   const Str<> str(caps.case_sensitive);
 
   Arena arena;
@@ -157,6 +177,26 @@ std::vector<const char*> ScanDirs(git_index* index, int root_fd, IndexDir* const
     dirty_candidates.push_back(path);
   };
 
+  // Ignored files are still remembered in IndexDir::unmatched because the ignore rules may change
+  // without affecting the stat of the directory.
+  auto AddUntracked = [&](const char* path) {
+    if (opts.ignore && opts.ignore->Ignored(StringView(path))) {
+      LOG(DEBUG) << "Ignored: " << Print(path);
+    } else {
+      AddCandidate("new", path);
+    }
+  };
+
+  auto Flush = [&] {
+    if (dirty_candidates.empty()) return;
+    StrSort(dirty_candidates.begin(), dirty_candidates.end(), caps.case_sensitive);
+    auto StrEq = [](const char* a, const char* b) { return !strcmp(a, b); };
+    dirty_candidates.erase(std::unique(dirty_candidates.begin(), dirty_candidates.end(), StrEq),
+                           dirty_candidates.end());
+    opts.on_candidates(std::move(dirty_candidates));
+    dirty_candidates.clear();
+  };
+
   constexpr ssize_t kDirStackSize = 5;
   int dir_fd[kDirStackSize];
   std::fill(std::begin(dir_fd), std::end(dir_fd), -1);
@@ -171,6 +211,11 @@ std::vector<const char*> ScanDirs(git_index* index, int root_fd, IndexDir* const
   if (begin != end) OpenTail(dir_fd, kDirStackSize, root_fd, (*begin)->path, arena);
 
   for (IndexDir* const* it = begin; it != end; ++it) {
+    if (dirty_candidates.size() >= kMinBatchSize) Flush();
+    if (opts.stop && opts.stop()) {
+      LOG(DEBUG) << "Stopping scan with " << (end - it) << " director(ies) left";
+      break;
+    }
     IndexDir& dir = **it;
 
     auto Basename = [&](const git_index_entry* e) { return e->path + dir.path.len; };
@@ -178,6 +223,7 @@ std::vector<const char*> ScanDirs(git_index* index, int root_fd, IndexDir* const
     auto AddUnmached = [&](StringView basename) {
       if (!basename.len) {
         dir.st = {};
+        dir.seeded = false;
         dir.unmatched.clear();
         dir.arena.Reuse();
       } else if (str.Eq(basename, StringView(".git/"))) {
@@ -185,15 +231,34 @@ std::vector<const char*> ScanDirs(git_index* index, int root_fd, IndexDir* const
       }
       char* path = dir.arena.StrCat(dir.path, basename);
       dir.unmatched.push_back(path);
-      AddCandidate(basename.len ? "new" : "unreadable", path);
+      if (basename.len) {
+        AddUntracked(path);
+      } else {
+        AddCandidate("unreadable", path);
+      }
+    };
+
+    auto Unchanged = [&](const git_index_entry* e) {
+      return opts.fsmonitor && index_file->FsmonitorValid(e) &&
+             !opts.fsmonitor->MayHaveChanged(StringView(e->path));
+    };
+
+    auto Modified = [&](const git_index_entry* e, const struct stat& st) {
+      if (!IsModified(e, st, caps)) return false;
+      if (opts.verified && opts.verified->Contains(*e, st)) {
+        LOG(DEBUG) << "Verified earlier as clean: " << Print(e->path);
+        return false;
+      }
+      return true;
     };
 
     auto StatFiles = [&]() {
       struct stat st;
       for (const git_index_entry* file : dir.files) {
+        if (Unchanged(file)) continue;
         if (fstatat(*dir_fd, Basename(file), &st, AT_SYMLINK_NOFOLLOW)) {
           AddCandidate(errno == ENOENT ? "deleted" : "unreadable", file->path);
-        } else if (IsModified(file, st, caps)) {
+        } else if (Modified(file, st)) {
           AddCandidate(nullptr, file->path);
         }
       }
@@ -234,9 +299,9 @@ std::vector<const char*> ScanDirs(git_index* index, int root_fd, IndexDir* const
         AddUnmached("");
         continue;
       }
-      if (opts.untracked_cache == Tribool::kTrue && StatEq(st, dir.st)) {
+      if (opts.untracked_cache == Tribool::kTrue && DirStatEq(st, dir.st)) {
         StatFiles();
-        for (const char* path : dir.unmatched) AddCandidate("new", path);
+        for (const char* path : dir.unmatched) AddUntracked(path);
         continue;
       }
       dir.st = st;
@@ -248,6 +313,7 @@ std::vector<const char*> ScanDirs(git_index* index, int root_fd, IndexDir* const
       AddUnmached("");
       continue;
     }
+    dir.seeded = false;
     dir.unmatched.clear();
     dir.arena.Reuse();
 
@@ -265,9 +331,11 @@ std::vector<const char*> ScanDirs(git_index* index, int root_fd, IndexDir* const
           AddCandidate("deleted", (*file)->path);
         } else if (cmp == 0) {
           struct stat st;
-          if (fstatat(*dir_fd, entry, &st, AT_SYMLINK_NOFOLLOW)) {
+          if (Unchanged(*file)) {
+            // Neither stat nor content have changed since the index was written.
+          } else if (fstatat(*dir_fd, entry, &st, AT_SYMLINK_NOFOLLOW)) {
             AddCandidate("unreadable", (*file)->path);
-          } else if (IsModified(*file, st, caps)) {
+          } else if (Modified(*file, st)) {
             AddCandidate(nullptr, (*file)->path);
           }
           matched = true;
@@ -300,11 +368,21 @@ std::vector<const char*> ScanDirs(git_index* index, int root_fd, IndexDir* const
     for (; file != file_end; ++file) AddCandidate("deleted", (*file)->path);
   }
 
-  return dirty_candidates;
+  Flush();
 }
 
 }  // namespace
 
+uint64_t HashTracked(const IndexDir& dir) {
+  uint64_t h = 14695981039346656037u;
+  for (const git_index_entry* e : dir.files) {
+    h = Hash(h, e->path + dir.path.len, std::strlen(e->path + dir.path.len));
+  }
+  h = Hash(h, "/", 1);
+  for (StringView subdir : dir.subdirs) h = Hash(h, subdir.ptr, subdir.len);
+  return h;
+}
+
 RepoCaps::RepoCaps(git_repository* repo, git_index* index) {
   trust_filemode = git_index_is_filemode_trustworthy(index);
   has_symlinks = git_index_supports_symlinks(index);
@@ -317,22 +395,41 @@ RepoCaps::RepoCaps(git_repository* repo, git_index* index) {
              << "precompose_unicode = " << std::boolalpha << precompose_unicode;
 }
 
-Index::Index(git_repository* repo, git_index* index)
+Index::Index(git_repository* repo, git_index* index, Index* prev)
     : dirs_(&arena_),
       splits_(&arena_),
-      git_index_(index),
       root_dir_(git_repository_workdir(repo)),
       caps_(repo, index) {
-  size_t total_weight = InitDirs(index);
+  size_t total_weight = InitDirs(git_index_entrycount(index), [index](size_t i) {
+    return git_index_get_byindex_no_sort(index, i);
+  });
+  InitSplits(total_weight);
+  if (prev) Inherit(*prev);
+}
+
+Index::Index(git_repository* repo, const RepoCaps& caps, std::unique_ptr<IndexFile> file,
+             Index* prev)
+    : file_(std::move(file)),
+      dirs_(&arena_),
+      splits_(&arena_),
+      root_dir_(git_repository_workdir(repo)),
+      caps_(caps) {
+  CHECK(file_);
+  const IndexFile* f = file_.get();
+  size_t total_weight = InitDirs(f->size(), [f](size_t i) { return f->entry(i); });
   InitSplits(total_weight);
+  if (prev) Inherit(*prev);
 }
 
-size_t Index::InitDirs(git_index* index) {
-  const Str<> str(git_index_is_case_sensitive(index));
-  const size_t index_size = git_index_entrycount(index);
+template <class Entry>
+size_t Index::InitDirs(size_t index_size, Entry entry_at) {
+  const Str<> str(caps_.case_sensitive);
   dirs_.reserve(index_size / 8);
   std::stack<IndexDir*> stack;
+  // dirs_.size() at the time the corresponding directory in `stack` was pushed.
+  std::stack<size_t> dirs_before;
   stack.push(arena_.DirectInit<IndexDir>(&arena_));
+  dirs_before.push(0);
 
   size_t total_weight = 0;
   auto PopDir = [&] {
@@ -342,13 +439,24 @@ size_t Index::InitDirs(git_index* index) {
     if (!std::is_sorted(top->subdirs.begin(), top->subdirs.end(), str.Lt)) {
       StrSort(top->subdirs.begin(), top->subdirs.end(), str.case_sensitive);
     }
-    total_weight += Weight(*top);
-    dirs_.push_back(top);
+    top->tracked = HashTracked(*top);
+    // A directory whose subtree has only skip-worktree entries stays in its parent's subdirs, so
+    // that it isn't untracked, but isn't scanned. In cone mode these are the directories outside
+    // the cone, which are usually missing.
+    if (top->depth == 0 || !top->files.empty() || dirs_.size() != dirs_before.top()) {
+      total_weight += Weight(*top);
+      dirs_.push_back(top);
+    }
     stack.pop();
+    dirs_before.pop();
   };
 
   for (size_t i = 0; i != index_size; ++i) {
-    const git_index_entry* entry = git_index_get_byindex_no_sort(index, i);
+    const git_index_entry* entry = entry_at(i);
+    if (entry->flags & GIT_INDEX_ENTRY_VALID) ++num_assume_unchanged_;
+    if (entry->flags_extended & GIT_INDEX_ENTRY_INTENT_TO_ADD) ++num_intent_to_add_;
+    const bool skip_worktree = entry->flags_extended & GIT_INDEX_ENTRY_SKIP_WORKTREE;
+    num_skip_worktree_ += skip_worktree;
     IndexDir* prev = stack.top();
     size_t common_len, common_depth;
     CommonDir(str, prev->path.ptr, entry->path, &common_len, &common_depth);
@@ -361,13 +469,15 @@ size_t Index::InitDirs(git_index* index) {
       StringView subdir(entry->path + top->path.len, p);
       top->subdirs.push_back(subdir);
       IndexDir* dir = arena_.DirectInit<IndexDir>(&arena_);
-      dir->path = StringView(entry->path, p - entry->path + 1);
-      dir->basename = subdir;
+      dir->path = StringView(arena_.StrDup(entry->path, p - entry->path + 1), p - entry->path + 1);
+      dir->basename = StringView(dir->path.ptr + top->path.len, subdir.len);
       dir->depth = stack.size();
       CHECK(dir->path.ptr[dir->path.len - 1] == '/');
       stack.push(dir);
+      dirs_before.push(dirs_.size());
     }
 
+    if (skip_worktree) continue;
     CHECK(!stack.empty());
     IndexDir* dir = stack.top();
     dir->files.push_back(entry);
@@ -404,53 +514,174 @@ void Index::InitSplits(size_t total_weight) {
   CHECK(std::adjacent_find(splits_.begin(), splits_.end()) == splits_.end());
 }
 
-std::vector<const char*> Index::GetDirtyCandidates(const ScanOpts& opts) {
-  int root_fd = open(root_dir_, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
-  VERIFY(root_fd >= 0);
-  ON_SCOPE_EXIT(&) { CHECK(!close(root_fd)) << Errno(); };
+void Index::Inherit(Index& prev) {
+  CHECK(!prev.Scanning());
+  if (prev.caps_.case_sensitive != caps_.case_sensitive ||
+      prev.caps_.precompose_unicode != caps_.precompose_unicode) {
+    return;
+  }
 
-  CHECK(!splits_.empty());
+  auto ByPath = [](const IndexDir* x, const IndexDir* y) {
+    int cmp = std::memcmp(x->path.ptr, y->path.ptr, std::min(x->path.len, y->path.len));
+    return cmp ? cmp < 0 : x->path.len < y->path.len;
+  };
+  std::vector<IndexDir*> from(prev.dirs_.begin(), prev.dirs_.end());
+  std::vector<IndexDir*> to(dirs_.begin(), dirs_.end());
+  std::sort(from.begin(), from.end(), ByPath);
+  std::sort(to.begin(), to.end(), ByPath);
+
+  size_t inherited = 0;
+  for (auto x = from.begin(), y = to.begin(); x != from.end() && y != to.end();) {
+    if (ByPath(*x, *y)) {
+      ++x;
+    } else if (ByPath(*y, *x)) {
+      ++y;
+    } else {
+      if ((*x)->tracked == (*y)->tracked) {
+        (*y)->st = (*x)->st;
+        (*y)->seeded = (*x)->seeded;
+        (*y)->arena = std::move((*x)->arena);
+        (*y)->unmatched = std::move((*x)->unmatched);
+        ++inherited;
+      }
+      ++x;
+      ++y;
+    }
+  }
+  LOG(INFO) << "Inherited untracked cache for " << inherited << " out of " << dirs_.size()
+            << " directories";
+}
 
+void Index::Seed(const std::vector<UntrackedDir>& dirs) {
+  CHECK(!Scanning());
+  // Paths in git's untracked cache are exactly as on disk.
+  if (!caps_.case_sensitive || caps_.precompose_unicode) return;
+
+  auto Lt = [](StringView x, StringView y) {
+    int cmp = std::memcmp(x.ptr, y.ptr, std::min(x.len, y.len));
+    return cmp ? cmp < 0 : x.len < y.len;
+  };
+  std::vector<IndexDir*> sorted(dirs_.begin(), dirs_.end());
+  std::sort(sorted.begin(), sorted.end(),
+            [&](const IndexDir* x, const IndexDir* y) { return Lt(x->path, y->path); });
+
+  size_t seeded = 0;
+  for (const UntrackedDir& src : dirs) {
+    StringView path(src.path.data(), src.path.size());
+    auto it = std::lower_bound(sorted.begin(), sorted.end(), path,
+                               [&](const IndexDir* x, StringView y) { return Lt(x->path, y); });
+    if (it == sorted.end() || Lt(path, (*it)->path)) continue;
+    IndexDir& dir = **it;
+    if (dir.st.st_mode || !dir.unmatched.empty()) continue;
+    dir.st = {};
+    MTim(dir.st) = src.mtime;
+    dir.st.st_ino = src.ino;
+    dir.st.st_size = src.size;
+    for (const std::string& name : src.untracked) {
+      dir.unmatched.push_back(dir.arena.StrCat(dir.path, name));
+    }
+    dir.seeded = true;
+    ++seeded;
+  }
+  LOG(INFO) << "Seeded untracked cache for " << seeded << " out of " << dirs_.size()
+            << " directories";
+}
+
+void Index::Unseed() {
+  CHECK(!Scanning());
+  size_t unseeded = 0;
+  for (IndexDir* dir : dirs_) {
+    if (!dir->seeded) continue;
+    dir->st = {};
+    dir->seeded = false;
+    dir->unmatched.clear();
+    dir->arena.Reuse();
+    ++unseeded;
+  }
+  LOG(INFO) << "Dropped seeded untracked cache for " << unseeded << " directories";
+}
+
+struct Index::Scan {
+  explicit Scan(int root_fd) : root_fd(root_fd) {}
+  ~Scan() { CHECK(!close(root_fd)) << Errno(); }
+
+  const int root_fd;
   std::mutex mutex;
   std::condition_variable cv;
-  size_t inflight = splits_.size() - 1;
+  size_t inflight = 0;
   bool error = false;
-  std::vector<const char*> res;
+};
+
+void Index::StartScan(const ScanOpts& opts) {
+  CHECK(!Scanning());
+  CHECK(opts.on_candidates);
+
+  int root_fd = open(root_dir_, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  VERIFY(root_fd >= 0);
+  scan_ = std::make_shared<Scan>(root_fd);
+
+  CHECK(!splits_.empty());
+  scan_->inflight = splits_.size() - 1;
 
   for (size_t i = 0; i != splits_.size() - 1; ++i) {
     size_t from = splits_[i];
     size_t to = splits_[i + 1];
 
-    GlobalThreadPool()->Schedule([&, from, to]() {
+    // The task holds a reference to the scan so that it can outlive this call if the deadline
+    // passes. The index itself waits for all tasks in Wait() before going away.
+    GlobalThreadPool()->Schedule([this, scan = scan_, opts, from, to]() {
       ON_SCOPE_EXIT(&) {
-        std::unique_lock<std::mutex> lock(mutex);
-        CHECK(inflight);
-        if (--inflight == 0) cv.notify_one();
+        std::unique_lock<std::mutex> lock(scan->mutex);
+        CHECK(scan->inflight);
+        if (--scan->inflight == 0) scan->cv.notify_all();
       };
       try {
-        std::vector<const char*> candidates =
-            ScanDirs(git_index_, root_fd, dirs_.data() + from, dirs_.data() + to, caps_, opts);
-        if (!candidates.empty()) {
-          std::unique_lock<std::mutex> lock(mutex);
-          res.insert(res.end(), candidates.begin(), candidates.end());
-        }
+        ScanDirs(scan->root_fd, dirs_.data() + from, dirs_.data() + to, caps_, opts, file_.get());
       } catch (const Exception&) {
-        std::unique_lock<std::mutex> lock(mutex);
-        error = true;
+        std::unique_lock<std::mutex> lock(scan->mutex);
+        scan->error = true;
       }
     });
   }
+}
 
+bool Index::WaitScan(Time deadline) {
+  CHECK(Scanning());
   {
-    std::unique_lock<std::mutex> lock(mutex);
-    while (inflight) cv.wait(lock);
+    std::unique_lock<std::mutex> lock(scan_->mutex);
+    while (scan_->inflight) {
+      if (deadline == Time::max()) {
+        scan_->cv.wait(lock);
+      } else if (scan_->cv.wait_until(lock, deadline) == std::cv_status::timeout &&
+                 scan_->inflight) {
+        LOG(INFO) << "Deadline exceeded with " << scan_->inflight
+                  << " directory shard(s) left to scan";
+        return false;
+      }
+    }
+    VERIFY(!scan_->error);
   }
 
-  VERIFY(!error);
-  StrSort(res.begin(), res.end(), git_index_is_case_sensitive(git_index_));
-  auto StrEq = [](const char* a, const char* b) { return !strcmp(a, b); };
-  res.erase(std::unique(res.begin(), res.end(), StrEq), res.end());
+  scan_.reset();
+  return true;
+}
+
+size_t Index::MemoryUsage() const {
+  CHECK(!Scanning());
+  size_t res = arena_.BlockBytes() + (file_ ? file_->MemoryUsage() : 0);
+  for (const IndexDir* dir : dirs_) {
+    res += dir->arena.BlockBytes() + dir->unmatched.capacity() * sizeof(dir->unmatched[0]);
+  }
   return res;
 }
 
+void Index::Wait() {
+  if (!scan_) return;
+  {
+    std::unique_lock<std::mutex> lock(scan_->mutex);
+    while (scan_->inflight) scan_->cv.wait(lock);
+  }
+  scan_.reset();
+}
+
 }  // namespace gitstatus
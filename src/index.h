@@ -23,13 +23,22 @@
 #include <git2.h>
 
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "arena.h"
+#include "fsmonitor.h"
+#include "ignore.h"
+#include "index_file.h"
 #include "options.h"
 #include "string_view.h"
+#include "time.h"
 #include "tribool.h"
+#include "untracked_cache.h"
+#include "verified_files.h"
 
 namespace gitstatus {
 
@@ -45,15 +54,36 @@ struct RepoCaps {
 struct ScanOpts {
   bool include_untracked;
   Tribool untracked_cache;
+  // If not null, files that the index marks as fsmonitor-valid and that aren't listed here
+  // aren't stat'ed. Used only with indices that come from an IndexFile.
+  std::shared_ptr<const FsmonitorChanges> fsmonitor;
+  // If not null, files whose stat doesn't match the index but is listed here aren't reported.
+  const VerifiedFiles* verified = nullptr;
+  // If not null, untracked files and directories that it ignores aren't reported.
+  IgnoreCache* ignore = nullptr;
+  // Called from the thread pool with sorted batches of dirty candidates as they are found,
+  // possibly concurrently. Batches never overlap. A shard of the directory index may produce
+  // several of them. Paths stay valid until the next scan or until the index is destroyed.
+  std::function<void(std::vector<const char*> candidates)> on_candidates;
+  // If set and returns true, the scan stops early. Directories that haven't been scanned keep
+  // their cached state.
+  std::function<bool()> stop;
 };
 
 struct IndexDir {
   explicit IndexDir(Arena* arena) : files(arena), subdirs(arena) {}
 
+  // `path` and `basename` are owned by the Index rather than by git_index, so that they stay
+  // valid after the git index is reloaded.
   StringView path;
   StringView basename;
   size_t depth = 0;
+  // Hash of the names of `files` and `subdirs`. If it's unchanged after the git index is
+  // reloaded, so is the set of untracked files in the directory.
+  uint64_t tracked = 0;
   struct stat st = {};
+  // True if `st` and `unmatched` come from git's untracked cache, which leaves out ignored files.
+  bool seeded = false;
   WithArena<std::vector<const git_index_entry*>> files;
   WithArena<std::vector<StringView>> subdirs;
 
@@ -61,22 +91,91 @@ struct IndexDir {
   std::vector<const char*> unmatched;
 };
 
+// Returns the value for IndexDir::tracked. Files and subdirectories must be in the same order as
+// in the index.
+uint64_t HashTracked(const IndexDir& dir);
+
 class Index {
  public:
-  Index(git_repository* repo, git_index* index);
-
-  std::vector<const char*> GetDirtyCandidates(const ScanOpts& opts);
+  // If `prev` is not null, it must have been built from an older version of the same git index,
+  // which may have been reloaded since. Directories whose tracked contents haven't changed
+  // inherit cached stats and untracked files from `prev`, which keeps the untracked cache warm
+  // across index updates. Requires: !prev->Scanning().
+  Index(git_repository* repo, git_index* index, Index* prev = nullptr);
+
+  // Same as above but entries come from `file` rather than from libgit2. Doesn't touch the
+  // git_index from which `caps` were obtained, so the latter can be reloaded concurrently.
+  Index(git_repository* repo, const RepoCaps& caps, std::unique_ptr<IndexFile> file,
+        Index* prev = nullptr);
+
+  Index(Index&&) = delete;
+  ~Index() { Wait(); }
+
+  // Fills the untracked cache of directories that don't have cached state yet with listings
+  // that git has cached in the index. They are used only if directory stats still match.
+  // Requires: !Scanning().
+  void Seed(const std::vector<UntrackedDir>& dirs);
+
+  // Forgets the cached state of directories that still have listings from Seed(). Must be called
+  // when ignore rules that these listings depend on change: unlike listings made by the scan,
+  // they don't have ignored files, so files that are no longer ignored would stay unreported.
+  // Requires: !Scanning().
+  void Unseed();
+
+  // Starts scanning the workdir for dirty candidates on the global thread pool.
+  // Requires: !Scanning().
+  void StartScan(const ScanOpts& opts);
+
+  // Blocks until the scan started by StartScan() finishes and returns true. All candidates have
+  // been passed to ScanOpts::on_candidates by then. If the deadline passes first, returns false;
+  // the directories that haven't been scanned yet are scanned in the background anyway to warm
+  // up the untracked cache for the next scan. Requires: Scanning().
+  bool WaitScan(Time deadline);
+
+  // Blocks until the scan started by StartScan() finishes.
+  void Wait();
+
+  // True if StartScan() has been called and neither WaitScan() has returned true nor Wait() has
+  // been called since.
+  bool Scanning() const { return scan_ != nullptr; }
+
+  const RepoCaps& caps() const { return caps_; }
+
+  // The file entries came from, or null if they came from libgit2.
+  const IndexFile* file() const { return file_.get(); }
+
+  // The number of entries with the skip-worktree bit. Their files aren't part of the directory
+  // index because git doesn't look at them in workdir. Directories that contain nothing else are
+  // listed in their parent's subdirs but aren't scanned: in a sparse checkout most of them are
+  // missing.
+  size_t num_skip_worktree() const { return num_skip_worktree_; }
+
+  // The number of entries with the assume-unchanged bit and with the intent-to-add bit. Unlike
+  // the entries counted by num_skip_worktree(), these are part of the directory index.
+  size_t num_assume_unchanged() const { return num_assume_unchanged_; }
+  size_t num_intent_to_add() const { return num_intent_to_add_; }
+
+  // Approximate number of bytes of heap memory owned by the index. Requires: !Scanning().
+  size_t MemoryUsage() const;
 
  private:
-  size_t InitDirs(git_index* index);
+  struct Scan;
+
+  template <class Entry>
+  size_t InitDirs(size_t index_size, Entry entry);
   void InitSplits(size_t total_weight);
+  void Inherit(Index& prev);
 
+  std::unique_ptr<IndexFile> file_;
   Arena arena_;
   WithArena<std::vector<IndexDir*>> dirs_;
   WithArena<std::vector<size_t>> splits_;
-  git_index* git_index_;
   const char* root_dir_;
   RepoCaps caps_;
+  size_t num_skip_worktree_ = 0;
+  size_t num_assume_unchanged_ = 0;
+  size_t num_intent_to_add_ = 0;
+  std::shared_ptr<Scan> scan_;
 };
 
 }  // namespace gitstatus
@@ -0,0 +1,413 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "index_file.h"
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <numeric>
+
+#include "bits.h"
+#include "check.h"
+#include "ewah.h"
+#include "print.h"
+#include "scope_guard.h"
+#include "string_view.h"
+#include "thread_pool.h"
+
+namespace gitstatus {
+
+namespace {
+
+constexpr size_t kHashSize = GIT_OID_RAWSZ;
+constexpr size_t kHeaderSize = 12;
+// ctime, mtime, dev, ino, mode, uid, gid, size, oid and flags.
+constexpr size_t kEntryFixedSize = 40 + kHashSize + 2;
+// Signature, size, offset and hash.
+constexpr size_t kEoieSize = 8 + 4 + kHashSize;
+
+size_t CacheTreeBytes(const CacheTree& node) {
+  size_t res = node.subtrees.capacity() * sizeof(CacheTree);
+  for (const CacheTree& subtree : node.subtrees) res += CacheTreeBytes(subtree);
+  return res;
+}
+
+}  // namespace
+
+std::unique_ptr<IndexFile> IndexFile::Read(const std::string& path, bool case_sensitive) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT) LOG(WARN) << "open: " << Print(path) << ": " << Errno();
+    return nullptr;
+  }
+  ON_SCOPE_EXIT(&) { CHECK(!close(fd)) << Errno(); };
+
+  std::unique_ptr<IndexFile> res(new IndexFile);
+  if (fstat(fd, &res->st_)) {
+    LOG(WARN) << "fstat: " << Print(path) << ": " << Errno();
+    return nullptr;
+  }
+  if (res->st_.st_size < static_cast<off_t>(kHeaderSize + kHashSize)) {
+    LOG(WARN) << "Index file is too short: " << Print(path);
+    return nullptr;
+  }
+
+  res->size_ = res->st_.st_size;
+  void* p = mmap(nullptr, res->size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) {
+    LOG(WARN) << "mmap: " << Print(path) << ": " << Errno();
+    return nullptr;
+  }
+  res->data_ = static_cast<const char*>(p);
+
+  if (!res->Parse(case_sensitive)) {
+    LOG(WARN) << "Cannot parse " << Print(path) << " natively; falling back to libgit2";
+    return nullptr;
+  }
+  LOG(INFO) << "Parsed " << res->size() << " entries from " << Print(path);
+  return res;
+}
+
+IndexFile::~IndexFile() {
+  if (data_) CHECK(!munmap(const_cast<char*>(data_), size_)) << Errno();
+}
+
+bool IndexFile::Extension(const char* sig, const char*& data, size_t& len) const {
+  for (const Ext& ext : exts_) {
+    if (!std::memcmp(ext.sig, sig, sizeof(ext.sig))) {
+      data = ext.data;
+      len = ext.len;
+      return true;
+    }
+  }
+  return false;
+}
+
+const git_index_entry* IndexFile::Find(const char* path) const {
+  auto cmp = case_sensitive_ ? std::strcmp : strcasecmp;
+  auto it = std::lower_bound(entries_.begin(), entries_.end(), path,
+                             [&](const git_index_entry& e, const char* p) {
+                               return cmp(e.path, p) < 0;
+                             });
+  // Case-insensitive order may put several paths that differ only in case next to each other.
+  for (; it != entries_.end() && !cmp(it->path, path); ++it) {
+    if (!std::strcmp(it->path, path) && GIT_INDEX_ENTRY_STAGE(&*it) == 0) return &*it;
+  }
+  return nullptr;
+}
+
+bool IndexFile::Tracked(const char* path) const {
+  auto cmp = case_sensitive_ ? std::strcmp : strcasecmp;
+  auto it = std::lower_bound(entries_.begin(), entries_.end(), path,
+                             [&](const git_index_entry& e, const char* p) {
+                               return cmp(e.path, p) < 0;
+                             });
+  if (it == entries_.end()) return false;
+  size_t len = std::strlen(path);
+  if (!len || path[len - 1] != '/') return !cmp(it->path, path);
+  return !(case_sensitive_ ? std::strncmp : strncasecmp)(it->path, path, len);
+}
+
+size_t IndexFile::MemoryUsage() const {
+  size_t res = entries_.capacity() * sizeof(entries_[0]) + exts_.capacity() * sizeof(exts_[0]) +
+               fsmonitor_valid_.capacity();
+  for (const Arena& arena : arenas_) res += arena.BlockBytes();
+  if (cache_tree_) res += sizeof(CacheTree) + CacheTreeBytes(*cache_tree_);
+  return res;
+}
+
+bool IndexFile::Parse(bool case_sensitive) {
+  if (std::memcmp(data_, "DIRC", 4)) return false;
+  version_ = Be32(data_ + 4);
+  std::memcpy(checksum_.id, data_ + size_ - kHashSize, kHashSize);
+  if (version_ < 2 || version_ > 4) return false;
+  size_t n = Be32(data_ + 8);
+  // Every entry takes at least this many bytes, so a corrupted count can't make us allocate a lot.
+  if (n > (size_ - kHeaderSize - kHashSize) / (kEntryFixedSize + 1)) return false;
+  entries_.resize(n);
+
+  // EOIE, if present, is the last extension. It points to the first extension, which allows us
+  // to read IEOT before decoding entries.
+  size_t ext_offset = 0;
+  if (size_ >= kHeaderSize + kEoieSize + kHashSize) {
+    const char* p = data_ + size_ - kHashSize - kEoieSize;
+    if (!std::memcmp(p, "EOIE", 4) && Be32(p + 4) == kEoieSize - 8) {
+      size_t offset = Be32(p + 8);
+      if (offset >= kHeaderSize && offset <= size_ - kHashSize - kEoieSize &&
+          ParseExtensions(offset, size_ - kHashSize)) {
+        ext_offset = offset;
+      }
+    }
+  }
+
+  // IEOT splits entries into blocks that can be decoded independently.
+  std::vector<Block> blocks;
+  const char* ieot;
+  size_t len;
+  if (ext_offset && Extension("IEOT", ieot, len) && len >= 4 && Be32(ieot) == 1 &&
+      (len - 4) % 8 == 0) {
+    size_t begin = 0;
+    for (size_t i = 4; i != len; i += 8) {
+      size_t offset = Be32(ieot + i);
+      size_t count = Be32(ieot + i + 4);
+      if (offset < kHeaderSize || offset >= ext_offset || count > n - begin ||
+          offset <= (blocks.empty() ? kHeaderSize - 1 : blocks.back().offset)) {
+        begin = -1;
+        break;
+      }
+      blocks.push_back({.offset = offset, .begin = begin, .end = begin + count});
+      begin += count;
+    }
+    if (begin != n || blocks.empty() || blocks.front().offset != kHeaderSize) blocks.clear();
+  }
+  if (blocks.empty()) blocks.push_back({.offset = kHeaderSize, .begin = 0, .end = n});
+
+  size_t entries_end;
+  if (!DecodeBlocks(blocks, entries_end)) return false;
+  if (ext_offset) {
+    if (entries_end != ext_offset) return false;
+  } else if (!ParseExtensions(entries_end, size_ - kHashSize)) {
+    return false;
+  }
+
+  for (const Ext& ext : exts_) {
+    // Extensions whose signature doesn't start with an uppercase letter are required. Split
+    // index ("link") and sparse index ("sdir") are among them.
+    if (ext.sig[0] < 'A' || ext.sig[0] > 'Z') {
+      LOG(INFO) << "Unsupported index extension: " << Print(StringView(ext.sig, 4));
+      return false;
+    }
+  }
+
+  if (!ParseFsmonitor()) {
+    LOG(WARN) << "Ignoring malformed FSMN index extension";
+    fsmonitor_version_ = 0;
+    fsmonitor_token_.clear();
+    fsmonitor_valid_.clear();
+  }
+
+  const char* tree;
+  if (Extension("TREE", tree, len)) {
+    cache_tree_.reset(new CacheTree);
+    if (!ParseCacheTree(tree, len, *cache_tree_)) {
+      LOG(WARN) << "Ignoring malformed TREE index extension";
+      cache_tree_.reset();
+    }
+  }
+
+  case_sensitive_ = case_sensitive;
+  if (!case_sensitive) {
+    // The same order as git_index_entry_icmp() in libgit2.
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      const git_index_entry& x = entries_[a];
+      const git_index_entry& y = entries_[b];
+      int cmp = strcasecmp(x.path, y.path);
+      return cmp ? cmp < 0 : GIT_INDEX_ENTRY_STAGE(&x) < GIT_INDEX_ENTRY_STAGE(&y);
+    });
+    std::vector<git_index_entry> entries(n);
+    for (size_t i = 0; i != n; ++i) entries[i] = entries_[order[i]];
+    entries_.swap(entries);
+    if (!fsmonitor_valid_.empty()) {
+      std::vector<char> valid(n);
+      for (size_t i = 0; i != n; ++i) valid[i] = fsmonitor_valid_[order[i]];
+      fsmonitor_valid_.swap(valid);
+    }
+  }
+
+  return true;
+}
+
+bool IndexFile::ParseFsmonitor() {
+  const char* p;
+  size_t len;
+  if (!Extension("FSMN", p, len)) return true;
+  const char* e = p + len;
+
+  if (len < 4) return false;
+  fsmonitor_version_ = Be32(p);
+  p += 4;
+  switch (fsmonitor_version_) {
+    case 1:
+      if (e - p < 8) return false;
+      fsmonitor_token_ = std::to_string(Be64(p));
+      p += 8;
+      break;
+    case 2: {
+      const char* nul = static_cast<const char*>(std::memchr(p, 0, e - p));
+      if (!nul) return false;
+      fsmonitor_token_.assign(p, nul);
+      p = nul + 1;
+      break;
+    }
+    default:
+      return false;
+  }
+
+  // The size of the bitmap in bytes followed by the bitmap itself. Set bits mark entries that
+  // may differ from workdir.
+  if (e - p < 4) return false;
+  p += 4;
+  Bitmap dirty;
+  if (!ReadEwah(p, e, dirty)) return false;
+  fsmonitor_valid_.assign(entries_.size(), true);
+  bool ok = true;
+  dirty.ForEach([&](size_t i) {
+    if (i < fsmonitor_valid_.size()) {
+      fsmonitor_valid_[i] = false;
+    } else {
+      ok = false;
+    }
+  });
+  return ok;
+}
+
+bool IndexFile::ParseExtensions(size_t offset, size_t end) {
+  exts_.clear();
+  while (offset != end) {
+    if (end - offset < 8) return false;
+    const char* p = data_ + offset;
+    size_t len = Be32(p + 4);
+    if (end - offset - 8 < len) return false;
+    Ext ext;
+    std::memcpy(ext.sig, p, sizeof(ext.sig));
+    ext.data = p + 8;
+    ext.len = len;
+    exts_.push_back(ext);
+    offset += 8 + len;
+  }
+  return true;
+}
+
+bool IndexFile::DecodeBlocks(const std::vector<Block>& blocks, size_t& entries_end) {
+  Arena::Options opt;
+  opt.min_block_size = 4 << 10;
+  opt.max_block_size = 1 << 20;
+  opt.max_alloc_threshold = 64 << 10;
+  arenas_.clear();
+  if (version_ >= 4) {
+    arenas_.reserve(blocks.size());
+    for (size_t i = 0; i != blocks.size(); ++i) arenas_.emplace_back(opt);
+  }
+  Arena dummy;
+  auto ArenaFor = [&](size_t i) -> Arena& { return arenas_.empty() ? dummy : arenas_[i]; };
+
+  std::vector<size_t> ends(blocks.size());
+  std::vector<char> ok(blocks.size());
+
+  if (blocks.size() == 1) {
+    ok[0] = DecodeBlock(blocks[0], ArenaFor(0), ends[0]);
+  } else {
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t inflight = blocks.size();
+    for (size_t i = 0; i != blocks.size(); ++i) {
+      GlobalThreadPool()->Schedule([&, i] {
+        bool res = DecodeBlock(blocks[i], ArenaFor(i), ends[i]);
+        std::unique_lock<std::mutex> lock(mutex);
+        ok[i] = res;
+        if (--inflight == 0) cv.notify_one();
+      });
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    while (inflight) cv.wait(lock);
+  }
+
+  for (size_t i = 0; i != blocks.size(); ++i) {
+    if (!ok[i]) return false;
+    if (i + 1 != blocks.size() && ends[i] != blocks[i + 1].offset) return false;
+  }
+  entries_end = ends.back();
+  return true;
+}
+
+bool IndexFile::DecodeBlock(const Block& block, Arena& arena, size_t& end) {
+  const char* p = data_ + block.offset;
+  const char* const e = data_ + size_ - kHashSize;
+
+  // Version 4 paths are stored as a suffix of the previous path. Every block starts afresh.
+  const char* prev = "";
+  size_t prev_len = 0;
+
+  for (size_t i = block.begin; i != block.end; ++i) {
+    const char* const start = p;
+    if (static_cast<size_t>(e - p) < kEntryFixedSize) return false;
+
+    git_index_entry& entry = entries_[i];
+    entry.ctime.seconds = Be32(p);
+    entry.ctime.nanoseconds = Be32(p + 4);
+    entry.mtime.seconds = Be32(p + 8);
+    entry.mtime.nanoseconds = Be32(p + 12);
+    entry.dev = Be32(p + 16);
+    entry.ino = Be32(p + 20);
+    entry.mode = Be32(p + 24);
+    entry.uid = Be32(p + 28);
+    entry.gid = Be32(p + 32);
+    entry.file_size = Be32(p + 36);
+    std::memcpy(entry.id.id, p + 40, kHashSize);
+    entry.flags = Be16(p + 40 + kHashSize);
+    entry.flags_extended = 0;
+    p += kEntryFixedSize;
+
+    if (entry.flags & GIT_INDEX_ENTRY_EXTENDED) {
+      if (version_ < 3 || e - p < 2) return false;
+      entry.flags_extended = Be16(p);
+      p += 2;
+    }
+
+    size_t strip = 0;
+    if (version_ >= 4 && (!Varint(p, e, strip) || strip > prev_len)) return false;
+    const char* nul = static_cast<const char*>(std::memchr(p, 0, e - p));
+    if (!nul) return false;
+    size_t len = prev_len - strip + (nul - p);
+    if ((entry.flags & GIT_INDEX_ENTRY_NAMEMASK) !=
+        std::min<size_t>(len, GIT_INDEX_ENTRY_NAMEMASK)) {
+      return false;
+    }
+
+    if (version_ < 4) {
+      entry.path = p;
+      // Padded with 1-8 NUL bytes to a multiple of 8.
+      size_t size = (p - start + len + 8) & ~size_t{7};
+      if (static_cast<size_t>(e - start) < size) return false;
+      p = start + size;
+    } else {
+      char* path = arena.Allocate<char>(len + 1);
+      std::memcpy(path, prev, prev_len - strip);
+      std::memcpy(path + (prev_len - strip), p, nul - p);
+      path[len] = 0;
+      entry.path = prev = path;
+      prev_len = len;
+      p = nul + 1;
+    }
+  }
+
+  end = p - data_;
+  return true;
+}
+
+}  // namespace gitstatus
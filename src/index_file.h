@@ -0,0 +1,139 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_INDEX_FILE_H_
+#define ROMKATV_GITSTATUS_INDEX_FILE_H_
+
+#include <sys/stat.h>
+
+#include <git2.h>
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+#include "cache_tree.h"
+
+namespace gitstatus {
+
+// Read-only view of a git index file parsed without libgit2. The file is mapped into memory and
+// entries are decoded straight from the mapping. Supports index versions 2, 3 and 4. If the
+// index has the EOIE and IEOT extensions (git writes them when index.threads is not 1), entries
+// are decoded in parallel on the global thread pool.
+//
+// Entries are git_index_entry structs so that they can be consumed by the same code that reads
+// libgit2 indices. Their order matches what libgit2 produces for the same `case_sensitive`.
+class IndexFile {
+ public:
+  // Returns null if the file doesn't exist, is malformed, or uses a feature that isn't supported
+  // (split index, sparse index or an unknown required extension). The reason is logged.
+  static std::unique_ptr<IndexFile> Read(const std::string& path, bool case_sensitive);
+
+  IndexFile(IndexFile&&) = delete;
+  ~IndexFile();
+
+  size_t size() const { return entries_.size(); }
+  const git_index_entry* entry(size_t i) const { return &entries_[i]; }
+
+  // Returns the stage 0 entry with exactly this path, or null if there is no such entry.
+  const git_index_entry* Find(const char* path) const;
+
+  // Returns true if there is an entry with this path at any stage or, if `path` ends with a
+  // slash, an entry under it. Compares paths case-insensitively unless case_sensitive().
+  bool Tracked(const char* path) const;
+
+  unsigned version() const { return version_; }
+
+  // If true, entries are in the order in which git writes them, which is also the order in which
+  // paths appear when walking tree objects.
+  bool case_sensitive() const { return case_sensitive_; }
+
+  // The trailing checksum of the file. Equal to git_index_checksum() of a git_index that was
+  // loaded from the same file.
+  const git_oid& checksum() const { return checksum_; }
+
+  // The result of fstat() on the file that was read.
+  const struct stat& st() const { return st_; }
+
+  // Finds the extension with the given 4-character signature. If found, stores its payload
+  // in `data` and `len` and returns true.
+  bool Extension(const char* sig, const char*& data, size_t& len) const;
+
+  // Version of the FSMN extension, or zero if the index doesn't have it. Git writes it when
+  // core.fsmonitor is set.
+  unsigned fsmonitor_version() const { return fsmonitor_version_; }
+
+  // The token to pass to the fsmonitor hook in order to find files that have changed since the
+  // index was written. For version 1 it's a timestamp in nanoseconds.
+  const std::string& fsmonitor_token() const { return fsmonitor_token_; }
+
+  // True if, according to the FSMN extension, `entry` matched the file in workdir as of
+  // fsmonitor_token(). Requires: `entry` is one of the entries of this IndexFile.
+  bool FsmonitorValid(const git_index_entry* entry) const {
+    return !fsmonitor_valid_.empty() && fsmonitor_valid_[entry - entries_.data()];
+  }
+
+  // The root of the cache tree from the TREE extension, or null if the index doesn't have one.
+  const CacheTree* cache_tree() const { return cache_tree_.get(); }
+
+  // Approximate number of bytes of heap memory owned by IndexFile. The mapping isn't included.
+  size_t MemoryUsage() const;
+
+ private:
+  struct Ext {
+    char sig[4];
+    const char* data;
+    size_t len;
+  };
+
+  struct Block {
+    size_t offset;
+    size_t begin;
+    size_t end;
+  };
+
+  IndexFile() = default;
+
+  bool Parse(bool case_sensitive);
+  bool ParseExtensions(size_t offset, size_t end);
+  bool ParseFsmonitor();
+  bool DecodeBlocks(const std::vector<Block>& blocks, size_t& entries_end);
+  bool DecodeBlock(const Block& block, Arena& arena, size_t& end);
+
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  struct stat st_ = {};
+  unsigned version_ = 0;
+  bool case_sensitive_ = true;
+  git_oid checksum_ = {};
+  std::vector<git_index_entry> entries_;
+  std::vector<Ext> exts_;
+  unsigned fsmonitor_version_ = 0;
+  std::string fsmonitor_token_;
+  // Parallel to entries_. Empty if there is no FSMN extension.
+  std::vector<char> fsmonitor_valid_;
+  std::unique_ptr<CacheTree> cache_tree_;
+  // Version 4 paths are prefix-compressed, so they are reconstructed here. One arena per block
+  // so that blocks can be decoded concurrently.
+  std::vector<Arena> arenas_;
+};
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_INDEX_FILE_H_
@@ -72,6 +72,13 @@ void PrintUsage() {
             << "   If non-negative, send signal 0 to the specified PID when not receiving any\n"
             << "   requests for one second; exit if signal sending fails.\n"
             << "\n"
+            << "  -S, --socket=PATH\n"
+            << "   Instead of reading requests from stdin and writing responses to stdout, listen\n"
+            << "   on this Unix domain socket and serve any number of clients. Responses are\n"
+            << "   written back to the connection the request came from. All clients share the\n"
+            << "   same repository cache and limits. Requests are processed one at a time in the\n"
+            << "   order they arrive, so a slow request delays requests from all clients.\n"
+            << "\n"
             << "  -t, --num-threads=NUM [default=1]\n"
             << "   Use this many threads to scan git workdir for unstaged and untracked files.\n"
             << "   Empirically, setting this parameter to twice the number of virtual CPU yields\n"
@@ -87,6 +94,13 @@ void PrintUsage() {
             << "   repo that's been closed is much slower than for a repo that hasn't been.\n"
             << "   Negative value means infinity.\n"
             << "\n"
+            << "  -M, --max-cache-mb=NUM [default=-1]\n"
+            << "   Keep the approximate memory used by cached repositories under this many\n"
+            << "   megabytes. Least recently used repositories are shrunk first (in-memory\n"
+            << "   indices and tags are dropped) and closed if that's not enough. Repositories\n"
+            << "   used by the last request, including submodules, are never shrunk or closed.\n"
+            << "   Negative value means infinity.\n"
+            << "\n"
             << "  -z, --max-commit-summary-length=NUM [default=256]\n"
             << "   Truncate commit summary if it's longer than this many bytes.\n"
             << "\n"
@@ -122,6 +136,18 @@ void PrintUsage() {
             << "   Unless this option is specified, report zero staged, unstaged and conflicted\n"
             << "   changes for repositories with bash.showDirtyState = false.\n"
             << "\n"
+            << "  -N, --native-index\n"
+            << "   Parse changed git index files natively and scan the workdir for unstaged and\n"
+            << "   untracked files while libgit2 is still loading the same index. Index files\n"
+            << "   with split index, sparse index or unknown required extensions are left to\n"
+            << "   libgit2. Also enables the use of git's untracked cache (core.untrackedCache)\n"
+            << "   and of the fsmonitor hook (core.fsmonitor) recorded in the index.\n"
+            << "\n"
+            << "  -R, --recurse-submodules\n"
+            << "   Scan checked out submodules and their submodules in parallel and report how\n"
+            << "   many of them have changes (see OUTPUT). Honors submodule.<name>.ignore.\n"
+            << "   Submodules are cached like any other repository.\n"
+            << "\n"
             << "  -V, --version\n"
             << "   Print gitstatusd version and exit.\n"
             << "\n"
@@ -135,9 +161,9 @@ void PrintUsage() {
             << "\n"
             << "INPUT\n"
             << "\n"
-            << "  Requests are read from stdin, separated by ascii 30 (record separator). Each\n"
-            << "  request is made of the following fields, in the specified order, separated by\n"
-            << "  ascii 31 (unit separator):\n"
+            << "  Requests are read from stdin (or from --socket clients), separated by ascii 30\n"
+            << "  (record separator). Each request is made of the following fields, in the\n"
+            << "  specified order, separated by ascii 31 (unit separator):\n"
             << "\n"
             << "    1. Request ID. Any string. Can be empty.\n"
             << "    2. Path to the directory for which git stats are being requested.\n"
@@ -145,17 +171,29 @@ void PrintUsage() {
             << "       is treated as GIT_DIR.\n"
             << "    3. (Optional) '1' to disable computation of anything that requires reading\n"
             << "       git index; '0' for the default behavior of computing everything.\n"
+            << "    4. (Optional) '1' to request a partial response (see OUTPUT) before the full\n"
+            << "       response; '0' for the default behavior of replying once.\n"
+            << "    5. (Optional) Time budget in milliseconds. When it runs out, gitstatusd\n"
+            << "       replies with whatever it knows and finishes the scan in the background\n"
+            << "       so that the next request is faster. Requires field 4. Empty value\n"
+            << "       means no time budget.\n"
+            << "    6. (Optional) Session. Any string. A request with non-empty session cancels\n"
+            << "       all earlier requests from the same client with the same session that\n"
+            << "       haven't been replied to yet. Requires fields 4 and 5.\n"
             << "\n"
             << "OUTPUT\n"
             << "\n"
-            << "  For every request read from stdin there is response written to stdout.\n"
-            << "  Responses are separated by ascii 30 (record separator). Each response is made\n"
-            << "  of the following fields, in the specified order, separated by ascii 31\n"
-            << "  (unit separator):\n"
+            << "  For every request there is response written to stdout (or to the --socket\n"
+            << "  client that sent the request). Responses are separated by ascii 30 (record\n"
+            << "  separator). Each response is made of the following fields, in the specified\n"
+            << "  order, separated by ascii 31 (unit separator):\n"
             << "\n"
             << "     1. Request id. The same as the first field in the request.\n"
             << "     2. 0 if the directory isn't a git repo, 1 otherwise. If 0, all the\n"
-            << "        following fields are missing.\n"
+            << "        following fields are missing. 2 if this is a partial response; it has\n"
+            << "        only fields 3-9 and is followed by another response to the same request.\n"
+            << "        3 if the request has been cancelled by a newer request from the same\n"
+            << "        session; all the following fields are missing.\n"
             << "     3. Absolute path to the git repository workdir.\n"
             << "     4. Commit hash that HEAD is pointing to. 40 hex digits.\n"
             << "     5. Local branch name or empty if not on a branch.\n"
@@ -184,9 +222,20 @@ void PrintUsage() {
             << "    27. Number of files in the index with assume-unchanged bit set.\n"
             << "    28. Encoding of the HEAD's commit message. Empty value means UTF-8.\n"
             << "    29. The first paragraph of the HEAD's commit message as one line.\n"
+            << "    30. The number of submodules with staged, unstaged or conflicted changes,\n"
+            << "        including changes in their own submodules. Present only with\n"
+            << "        --recurse-submodules.\n"
+            << "    31. The number of submodules with untracked files. Present only with\n"
+            << "        --recurse-submodules.\n"
+            << "    32. 1 if some fields are unknown because the time budget ran out, 0\n"
+            << "        otherwise. Present only if the request has a time budget. This is field\n"
+            << "        30 without --recurse-submodules.\n"
             << "\n"
             << "Note: Renamed files are reported as deleted plus new.\n"
             << "\n"
+            << "Note: Numeric fields that are unknown because the time budget ran out are -1.\n"
+            << "Tag is empty if unknown.\n"
+            << "\n"
             << "EXAMPLE\n"
             << "\n"
             << "  Send a single request and print response (zsh syntax):\n"
@@ -258,9 +307,11 @@ Options ParseOptions(int argc, char** argv) {
                                 {"version-glob", required_argument, nullptr, 'G'},
                                 {"lock-fd", required_argument, nullptr, 'l'},
                                 {"parent-pid", required_argument, nullptr, 'p'},
+                                {"socket", required_argument, nullptr, 'S'},
                                 {"num-threads", required_argument, nullptr, 't'},
                                 {"log-level", required_argument, nullptr, 'v'},
                                 {"repo-ttl-seconds", required_argument, nullptr, 'r'},
+                                {"max-cache-mb", required_argument, nullptr, 'M'},
                                 {"max-commit-summary-length", required_argument, nullptr, 'z'},
                                 {"max-num-staged", required_argument, nullptr, 's'},
                                 {"max-num-unstaged", required_argument, nullptr, 'u'},
@@ -271,10 +322,12 @@ Options ParseOptions(int argc, char** argv) {
                                 {"ignore-status-show-untracked-files", no_argument, nullptr, 'U'},
                                 {"ignore-bash-show-untracked-files", no_argument, nullptr, 'W'},
                                 {"ignore-bash-show-dirty-state", no_argument, nullptr, 'D'},
+                                {"native-index", no_argument, nullptr, 'N'},
+                                {"recurse-submodules", no_argument, nullptr, 'R'},
                                 {}};
   Options res;
   while (true) {
-    switch (getopt_long(argc, argv, "hVG:l:p:t:v:r:z:s:u:c:d:m:eUWD", opts, nullptr)) {
+    switch (getopt_long(argc, argv, "hVG:l:p:S:t:v:r:M:z:s:u:c:d:m:eUWDNR", opts, nullptr)) {
       case -1:
         if (optind != argc) {
           std::cerr << "unexpected positional argument: " << argv[optind] << std::endl;
@@ -305,6 +358,9 @@ Options ParseOptions(int argc, char** argv) {
       case 'p':
         res.parent_pid = ParseInt(optarg);
         break;
+      case 'S':
+        res.socket = optarg;
+        break;
       case 'v':
         if (!ParseLogLevel(optarg, res.log_level)) {
           std::cerr << "invalid log level: " << optarg << std::endl;
@@ -314,6 +370,11 @@ Options ParseOptions(int argc, char** argv) {
       case 'r':
         res.repo_ttl = std::chrono::seconds(ParseLong(optarg));
         break;
+      case 'M': {
+        size_t mb = ParseSizeT(optarg);
+        res.max_cache_bytes = mb == static_cast<size_t>(-1) ? mb : mb << 20;
+        break;
+      }
       case 't': {
         long n = ParseLong(optarg);
         if (n <= 0) {
@@ -353,6 +414,12 @@ Options ParseOptions(int argc, char** argv) {
       case 'D':
         res.ignore_bash_show_dirty_state = true;
         break;
+      case 'N':
+        res.native_index = true;
+        break;
+      case 'R':
+        res.recurse_submodules = true;
+        break;
       default:
         std::exit(10);
     }
@@ -51,6 +51,9 @@ struct Limits {
   // Unless true, report zero staged, unstaged and conflicted changes for repositories with
   // bash.showDirtyState = false.
   bool ignore_bash_show_dirty_state = false;
+  // If true, parse changed git index files natively in addition to libgit2 so that the workdir
+  // scan doesn't have to wait for libgit2 to finish loading the index.
+  bool native_index = false;
 };
 
 struct Options : Limits {
@@ -69,6 +72,14 @@ struct Options : Limits {
   // such as memory and file descriptors. The next request for a repo that's been closed is much
   // slower than for a repo that hasn't been. Negative value means infinity.
   Duration repo_ttl = std::chrono::seconds(3600);
+  // Keep the approximate memory used by cached repositories under this many bytes by shrinking
+  // and closing the least recently used repositories.
+  size_t max_cache_bytes = -1;
+  // If not empty, listen on this Unix domain socket for requests from any number of clients
+  // instead of reading requests from stdin.
+  std::string socket;
+  // If true, scan submodules recursively and report how many of them have changes.
+  bool recurse_submodules = false;
 };
 
 Options ParseOptions(int argc, char** argv);
@@ -26,6 +26,7 @@
 #include <atomic>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <exception>
 #include <iterator>
 #include <memory>
@@ -35,6 +36,7 @@
 #include "arena.h"
 #include "check.h"
 #include "check_dir_mtime.h"
+#include "content_check.h"
 #include "dir.h"
 #include "git.h"
 #include "print.h"
@@ -43,6 +45,8 @@
 #include "string_cmp.h"
 #include "thread_pool.h"
 #include "timer.h"
+#include "tree_diff.h"
+#include "untracked_cache.h"
 
 namespace gitstatus {
 
@@ -101,7 +105,9 @@ bool Repo::Shard::Contains(Str<> str, StringView path) const {
   return !str.Lt(end_s, path);
 }
 
-Repo::Repo(git_repository* repo, Limits lim) : lim_(std::move(lim)), repo_(repo), tag_db_(repo) {
+Repo::Repo(git_repository* repo, Limits lim, std::shared_ptr<CommonDir> common)
+    : base_lim_(std::move(lim)), lim_(base_lim_), repo_(repo), common_(std::move(common)) {
+  CHECK(common_);
   if (lim_.max_num_untracked) {
     GlobalThreadPool()->Schedule([this] {
       bool check = CheckDirMtime(git_repository_path(repo_));
@@ -116,6 +122,9 @@ Repo::Repo(git_repository* repo, Limits lim) : lim_(std::move(lim)), repo_(repo)
 }
 
 Repo::~Repo() {
+  // Scans abandoned on deadline may still be running.
+  Wait();
+  if (index_) index_->Wait();
   {
     std::unique_lock<std::mutex> lock(mutex_);
     while (untracked_cache_ == Tribool::kUnknown) cv_.wait(lock);
@@ -124,8 +133,27 @@ Repo::~Repo() {
   git_repository_free(repo_);
 }
 
-IndexStats Repo::GetIndexStats(const git_oid* head, git_config* cfg) {
-  ON_SCOPE_EXIT(this, orig_lim = lim_) { lim_ = orig_lim; };
+IndexStats Repo::GetIndexStats(const git_oid* head, git_config* cfg, Time deadline,
+                               Cancellation cancel) {
+  // Let the scans from the previous call finish if it returned on deadline. Their results are
+  // still good unless they failed.
+  Wait();
+  if (index_) index_->Wait();
+  {
+    // Candidates that arrived after the previous call had returned.
+    std::unique_lock<std::mutex> lock(candidates_mutex_);
+    pending_.clear();
+  }
+  // Staged counters are incomplete if the scan failed or was cut short.
+  if (Load(error_) || cancel_.Cancelled()) head_ = {};
+  cancel_ = std::move(cancel);
+  // Reset before the workdir scan starts. It may start before the git index is reloaded.
+  Store(error_, false);
+  Store(unstaged_, {});
+  Store(untracked_, {});
+  Store(unstaged_deleted_, {});
+
+  lim_ = base_lim_;
   auto Off = [&](const char* name) {
     int val;
     if (git_config_get_bool(&val, cfg, name) || val) return false;
@@ -144,15 +172,94 @@ IndexStats Repo::GetIndexStats(const git_oid* head, git_config* cfg) {
     lim_.max_num_conflicted = 0;
   }
 
+  const bool want_dirty = lim_.max_num_unstaged || lim_.max_num_untracked;
+  if (lim_.native_index) ignore_.Refresh(repo_, cfg);
+  ScanOpts scan_opts = {.include_untracked = lim_.max_num_untracked > 0,
+                        .untracked_cache = Load(untracked_cache_),
+                        .verified = &verified_,
+                        .ignore = lim_.native_index ? &ignore_ : nullptr,
+                        .on_candidates =
+                            [this](std::vector<const char*> paths) {
+                              OnCandidates(std::move(paths));
+                            },
+                        .stop = [this] { return Stopped() || DirtyDone(); }};
+  auto StartScan = [&] {
+    // Seeded listings lack ignored files, so they are dropped once an ignore file they depend
+    // on changes. The scan then lists these directories again.
+    auto Changed = [](const std::pair<std::string, struct stat>& file) {
+      struct stat st;
+      if (stat(file.first.c_str(), &st)) st = {};
+      return !StatEq(st, file.second);
+    };
+    if (std::any_of(seed_ignore_files_.begin(), seed_ignore_files_.end(), Changed)) {
+      index_->Unseed();
+      seed_ignore_files_.clear();
+    }
+    scan_opts.fsmonitor = QueryFsmonitor(cfg, deadline);
+    index_->StartScan(scan_opts);
+  };
+  // Git's own untracked cache is useful only when starting from scratch.
+  auto Seed = [&] {
+    seed_ignore_files_.clear();
+    if (!scan_opts.include_untracked || scan_opts.untracked_cache == Tribool::kFalse) return;
+    UntrackedCache cache = ReadUntrackedCache(*index_->file(), repo_, cfg);
+    index_->Seed(cache.dirs);
+    seed_ignore_files_ = std::move(cache.ignore_files);
+  };
+
+  // The directory index built from the previous version of the git index, if it has just been
+  // reloaded. Only paths and untracked files are read from it; its entries are gone.
+  std::unique_ptr<Index> prev_index;
   if (git_index_) {
     int new_index;
-    VERIFY(!git_index_read_ex(git_index_, 0, &new_index)) << GitError();
+    std::unique_ptr<IndexFile> file;
+    if (lim_.native_index && want_dirty) {
+      file = ReadIndexFile(git_index_is_case_sensitive(git_index_));
+    }
+    if (file) {
+      RepoCaps caps(repo_, git_index_);
+      // Let libgit2 load the same file in the background while we build the directory index
+      // from our own parse and start scanning the workdir.
+      auto* promise = new std::promise<int>;
+      std::future<int> reload = promise->get_future();
+      GlobalThreadPool()->Schedule([=] {
+        ON_SCOPE_EXIT(&) { delete promise; };
+        int res;
+        if (git_index_read_ex(git_index_, 0, &res)) {
+          LOG(ERROR) << "git_index_read_ex: " << GitError();
+          promise->set_exception(std::make_exception_ptr(Exception()));
+        } else {
+          promise->set_value(res);
+        }
+      });
+      ON_SCOPE_EXIT(&) {
+        if (reload.valid()) reload.wait();
+      };
+      size_t file_size = file->size();
+      prev_index = std::move(index_);
+      index_ = std::make_unique<Index>(repo_, caps, std::move(file), prev_index.get());
+      if (!prev_index) Seed();
+      if (file_size <= lim_.dirty_max_index_size) StartScan();
+      new_index = reload.get();
+    } else {
+      VERIFY(!git_index_read_ex(git_index_, 0, &new_index)) << GitError();
+      if (new_index) prev_index = std::move(index_);
+    }
     if (new_index) {
       head_ = {};
-      index_.reset();
+      counted_ = false;
     }
   } else {
     VERIFY(!git_repository_index(&git_index_, repo_)) << GitError();
+    if (lim_.native_index && want_dirty) {
+      // The index has just been loaded by libgit2 but our own parse gives access to the
+      // extensions that libgit2 ignores.
+      auto file = ReadIndexFile(git_index_is_case_sensitive(git_index_));
+      if (file && file->size() <= lim_.dirty_max_index_size) {
+        index_ = std::make_unique<Index>(repo_, RepoCaps(repo_, git_index_), std::move(file));
+        Seed();
+      }
+    }
     // Query an attribute (doesn't matter which) to initialize repo's attribute
     // cache. It's a workaround for synchronization bugs (data races) in libgit2
     // that result from lazy cache initialization without synchronization.
@@ -162,12 +269,19 @@ IndexStats Repo::GetIndexStats(const git_oid* head, git_config* cfg) {
   }
 
   UpdateShards();
-  Store(error_, false);
-  Store(unstaged_, {});
-  Store(untracked_, {});
-  Store(unstaged_deleted_, {});
 
-  std::vector<const char*> dirty_candidates;
+  // The directory index counts entries when it's built, so a fresh one saves a pass over the
+  // index.
+  if (!counted_ && IndexMatches()) {
+    Store(skip_worktree_, index_->num_skip_worktree());
+    Store(assume_unchanged_, index_->num_assume_unchanged());
+    Store(intent_to_add_, index_->num_intent_to_add());
+    counted_ = true;
+  }
+
+  bool staged_complete = true;
+  bool dirty_complete = true;
+  bool counting = false;
   const size_t index_size = git_index_entrycount(git_index_);
 
   if (!lim_.max_num_staged && !lim_.max_num_conflicted) {
@@ -178,6 +292,8 @@ IndexStats Repo::GetIndexStats(const git_oid* head, git_config* cfg) {
     Store(staged_deleted_, {});
     Store(skip_worktree_, {});
     Store(assume_unchanged_, {});
+    Store(intent_to_add_, {});
+    counted_ = false;
   } else if (head) {
     if (git_oid_equal(head, &head_)) {
       LOG(INFO) << "Index and HEAD unchanged; staged = " << Load(staged_)
@@ -188,45 +304,66 @@ IndexStats Repo::GetIndexStats(const git_oid* head, git_config* cfg) {
       Store(conflicted_, {});
       Store(staged_new_, {});
       Store(staged_deleted_, {});
-      Store(skip_worktree_, {});
-      Store(assume_unchanged_, {});
+      if (!counted_) {
+        Store(skip_worktree_, {});
+        Store(assume_unchanged_, {});
+        Store(intent_to_add_, {});
+        StartCount(/* no_head = */ false);
+        counting = true;
+      }
       StartStagedScan(head);
     }
   } else {
+    // Without HEAD every entry except intent-to-add is a staged new file.
     head_ = {};
-    size_t staged = 0;
-    size_t skip_worktree = 0;
-    size_t assume_unchanged = 0;
-    for (size_t i = 0; i != index_size; ++i) {
-      const git_index_entry* entry = git_index_get_byindex_no_sort(git_index_, i);
-      if (!(entry->flags_extended & GIT_INDEX_ENTRY_INTENT_TO_ADD)) ++staged;
-      if (entry->flags_extended & GIT_INDEX_ENTRY_SKIP_WORKTREE) ++skip_worktree;
-      if (entry->flags & GIT_INDEX_ENTRY_VALID) ++assume_unchanged;
-    }
-    Store(staged_, staged);
     Store(conflicted_, {});
-    Store(staged_new_, staged);
     Store(staged_deleted_, {});
-    Store(skip_worktree_, skip_worktree);
-    Store(assume_unchanged_, assume_unchanged);
+    if (counted_) {
+      size_t staged = index_size - Load(intent_to_add_);
+      Store(staged_, staged);
+      Store(staged_new_, staged);
+    } else {
+      Store(staged_, {});
+      Store(staged_new_, {});
+      Store(skip_worktree_, {});
+      Store(assume_unchanged_, {});
+      Store(intent_to_add_, {});
+      StartCount(/* no_head = */ true);
+      counting = true;
+    }
   }
 
-  if (index_size <= lim_.dirty_max_index_size &&
-      (lim_.max_num_unstaged || lim_.max_num_untracked)) {
-    if (!index_) index_ = std::make_unique<Index>(repo_, git_index_);
-    dirty_candidates = index_->GetDirtyCandidates({.include_untracked = lim_.max_num_untracked > 0,
-                                                   .untracked_cache = Load(untracked_cache_)});
-    if (dirty_candidates.empty()) {
-      LOG(INFO) << "Clean repo: no dirty candidates";
-    } else {
-      LOG(INFO) << "Found " << dirty_candidates.size() << " dirty candidate(s) spanning from "
-                << Print(dirty_candidates.front()) << " to " << Print(dirty_candidates.back());
+  if (index_size <= lim_.dirty_max_index_size && want_dirty) {
+    if (!index_) index_ = std::make_unique<Index>(repo_, git_index_, prev_index.get());
+    if (!index_->Scanning()) StartScan();
+    // Candidates found so far have been queued. From now on they are verified as soon as they
+    // are found, and the scan stops once the limits on unstaged and untracked files are reached.
+    std::vector<const char*> pending;
+    {
+      std::unique_lock<std::mutex> lock(candidates_mutex_);
+      streaming_ = true;
+      pending.swap(pending_);
     }
-    StartDirtyScan(dirty_candidates);
+    ON_SCOPE_EXIT(&) {
+      std::unique_lock<std::mutex> lock(candidates_mutex_);
+      streaming_ = false;
+    };
+    OnCandidates(std::move(pending));
+    if (!index_->WaitScan(deadline)) dirty_complete = false;
   }
 
-  Wait();
+  if (!Wait(deadline) && !cancel_.Cancelled()) {
+    if (staged_inflight_.load(std::memory_order_acquire)) staged_complete = false;
+    if (dirty_inflight_.load(std::memory_order_acquire)) dirty_complete = false;
+    LOG(INFO) << "Deadline exceeded; staged " << (staged_complete ? "complete" : "incomplete")
+              << ", dirty " << (dirty_complete ? "complete" : "incomplete");
+  }
   VERIFY(!Load(error_));
+  // Counting tasks are skipped only when the scans stop, so once they are all done the counts
+  // are final until git_index_ is reloaded.
+  if (counting && !staged_inflight_.load(std::memory_order_acquire) && !Stopped()) {
+    counted_ = true;
+  }
 
   size_t num_staged = std::min(Load(staged_), lim_.max_num_staged);
   size_t num_unstaged = std::min(Load(unstaged_), lim_.max_num_unstaged);
@@ -239,7 +376,9 @@ IndexStats Repo::GetIndexStats(const git_oid* head, git_config* cfg) {
           .num_staged_deleted = std::min(Load(staged_deleted_), num_staged),
           .num_unstaged_deleted = std::min(Load(unstaged_deleted_), num_unstaged),
           .num_skip_worktree = Load(skip_worktree_),
-          .num_assume_unchanged = Load(assume_unchanged_)};
+          .num_assume_unchanged = Load(assume_unchanged_),
+          .staged_complete = staged_complete,
+          .dirty_complete = dirty_complete};
 }
 
 int Repo::OnDelta(const char* type, const git_diff_delta& d, std::atomic<size_t>& c1, size_t m1,
@@ -268,7 +407,6 @@ void Repo::StartDirtyScan(const std::vector<const char*>& paths) {
   if (paths.empty()) return;
 
   git_diff_options opt = GIT_DIFF_OPTIONS_INIT;
-  opt.payload = this;
   opt.flags = GIT_DIFF_INCLUDE_TYPECHANGE_TREES | GIT_DIFF_SKIP_BINARY_CHECK |
               GIT_DIFF_DISABLE_PATHSPEC_MATCH | GIT_DIFF_EXEMPLARS;
   if (lim_.max_num_untracked) {
@@ -278,40 +416,113 @@ void Repo::StartDirtyScan(const std::vector<const char*>& paths) {
     opt.flags |= GIT_DIFF_ENABLE_FAST_UNTRACKED_DIRS;
   }
   opt.ignore_submodules = GIT_SUBMODULE_IGNORE_DIRTY;
+
+  struct Payload {
+    Repo* repo;
+    // Paths that libgit2 has found dirty. Other files it has compared are clean.
+    std::vector<std::string> dirty;
+    // True if libgit2 has been told to skip the rest of a delta type. It stops comparing files
+    // of that type and still succeeds, so the files it hasn't reported aren't known to be clean.
+    bool skipped = false;
+  };
   opt.notify_cb = +[](const git_diff* diff, const git_diff_delta* delta,
                       const char* matched_pathspec, void* payload) -> int {
+    Payload* p = static_cast<Payload*>(payload);
+    p->dirty.push_back(delta->old_file.path);
     if (delta->status == GIT_DELTA_CONFLICTED) return GIT_DIFF_DELTA_DO_NOT_INSERT;
-    Repo* repo = static_cast<Repo*>(payload);
-    if (Load(repo->error_)) return GIT_EUSER;
-    if (delta->status == GIT_DELTA_UNTRACKED) {
-      return repo->OnDelta("untracked", *delta, repo->untracked_, repo->lim_.max_num_untracked,
-                           repo->unstaged_, repo->lim_.max_num_unstaged);
-    } else {
-      if (delta->status == GIT_DELTA_DELETED) Inc(repo->unstaged_deleted_);
-      return repo->OnDelta("unstaged", *delta, repo->unstaged_, repo->lim_.max_num_unstaged,
-                           repo->untracked_, repo->lim_.max_num_untracked);
-    }
+    if (p->repo->Stopped()) return GIT_EUSER;
+    int res = p->repo->OnDirtyDelta(*delta);
+    if (res >= 0 && (res & GIT_DIFF_DELTA_SKIP_TYPE)) p->skipped = true;
+    return res;
   };
+  // Called for every file, including unmodified ones. Lets a cancelled scan of a clean
+  // shard stop early, as well as shards whose results are no longer needed.
+  opt.progress_cb = +[](const git_diff* diff, const char* old_path, const char* new_path,
+                        void* payload) -> int {
+    Repo* repo = static_cast<Payload*>(payload)->repo;
+    return repo->Stopped() || repo->DirtyDone() ? GIT_EUSER : 0;
+  };
+
+  // Tracked candidates can be checked by content without libgit2 if we can find their entries.
+  // The candidates come from index_, so its file has them. Untracked files that aren't ignored
+  // need no checks. Entries must be the same as in git_index_ so that libgit2 and we agree on
+  // what the index says.
+  const IndexFile* file = index_ ? index_->file() : nullptr;
+  if (file && !git_oid_equal(&file->checksum(), git_index_checksum(git_index_))) file = nullptr;
 
   const Str<> str(git_index_is_case_sensitive(git_index_));
   auto shard = shards_.begin();
   for (auto p = paths.begin(); p != paths.end();) {
-    opt.range_start = *p;
-    opt.range_end = *p;
-    opt.pathspec.strings = const_cast<char**>(&*p);
-    opt.pathspec.count = 1;
     while (!shard->Contains(str, StringView(*p))) ++shard;
-    while (++p != paths.end() && shard->Contains(str, StringView(*p))) {
-      opt.range_end = *p;
-      ++opt.pathspec.count;
-    }
-    RunAsync([this, opt]() {
+    auto end = std::find_if(
+        p, paths.end(), [&](const char* path) { return !shard->Contains(str, StringView(path)); });
+    // The task may outlive the request, so it owns copies of its paths instead of pointing into
+    // storage of the caller.
+    std::vector<std::string> group(p, end);
+    p = end;
+    RunAsync(dirty_inflight_, [this, opt, file, group = std::move(group)]() mutable {
+      std::vector<const char*> rest;
+      if (file) {
+        for (const std::string& s : group) {
+          const char* path = s.c_str();
+          if (Stopped() || DirtyDone()) return;
+          git_diff_delta delta = {};
+          delta.old_file.path = delta.new_file.path = path;
+          const git_index_entry* entry = file->Find(path);
+          if (!entry) {
+            if (!Untracked(*file, path)) {
+              rest.push_back(path);
+              continue;
+            }
+            delta.status = GIT_DELTA_UNTRACKED;
+            if (OnDirtyDelta(delta) == GIT_EUSER) return;
+            continue;
+          }
+          struct stat st;
+          time_t checked_at = std::time(nullptr);
+          switch (CheckContent(repo_, index_->caps(), *entry, st)) {
+            case ContentStatus::kClean:
+              verified_.Add(*entry, st, checked_at);
+              continue;
+            case ContentStatus::kModified:
+              delta.status = GIT_DELTA_MODIFIED;
+              break;
+            case ContentStatus::kDeleted:
+              delta.status = GIT_DELTA_DELETED;
+              break;
+            case ContentStatus::kUnknown:
+              rest.push_back(path);
+              continue;
+          }
+          if (OnDirtyDelta(delta) == GIT_EUSER) return;
+        }
+        if (rest.empty()) return;
+        LOG(DEBUG) << "Checked " << group.size() - rest.size() << " out of " << group.size()
+                   << " dirty candidate(s) natively";
+      } else {
+        rest.reserve(group.size());
+        for (const std::string& path : group) rest.push_back(path.c_str());
+      }
+
+      Payload payload = {.repo = this};
+      opt.payload = &payload;
+      opt.range_start = rest.front();
+      opt.range_end = rest.back();
+      opt.pathspec.strings = const_cast<char**>(rest.data());
+      opt.pathspec.count = rest.size();
       git_diff* diff = nullptr;
       LOG(DEBUG) << "git_diff_index_to_workdir from " << Print(opt.range_start) << " to "
                  << Print(opt.range_end);
+      time_t checked_at = std::time(nullptr);
       switch (git_diff_index_to_workdir(&diff, repo_, git_index_, &opt)) {
         case 0:
           git_diff_free(diff);
+          // Remember the files that libgit2 has found clean so that the next scan doesn't
+          // report them as candidates again. These are mostly files that need filters. If
+          // libgit2 has skipped some of them, there is no telling which.
+          if (file && !payload.skipped) {
+            RememberClean(*file, rest, std::move(payload.dirty), checked_at);
+          }
           break;
         case GIT_EUSER:
           break;
@@ -323,12 +534,152 @@ void Repo::StartDirtyScan(const std::vector<const char*>& paths) {
   }
 }
 
+void Repo::RememberClean(const IndexFile& file, const std::vector<const char*>& paths,
+                         std::vector<std::string> dirty, time_t checked_at) {
+  std::sort(dirty.begin(), dirty.end());
+  std::string path = git_repository_workdir(repo_);
+  const size_t workdir_len = path.size();
+  for (const char* p : paths) {
+    if (std::binary_search(dirty.begin(), dirty.end(), p)) continue;
+    // libgit2 doesn't look at files with these flags.
+    const git_index_entry* entry = file.Find(p);
+    if (!entry || (entry->flags & GIT_INDEX_ENTRY_VALID) ||
+        (entry->flags_extended & (GIT_INDEX_ENTRY_SKIP_WORKTREE | GIT_INDEX_ENTRY_INTENT_TO_ADD)) ||
+        !(S_ISREG(entry->mode) || S_ISLNK(entry->mode))) {
+      continue;
+    }
+    struct stat st;
+    path.resize(workdir_len);
+    path += p;
+    if (!lstat(path.c_str(), &st)) verified_.Add(*entry, st, checked_at);
+  }
+}
+
+void Repo::OnCandidates(std::vector<const char*> paths) {
+  if (paths.empty()) return;
+  std::unique_lock<std::mutex> lock(candidates_mutex_);
+  if (!streaming_) {
+    pending_.insert(pending_.end(), paths.begin(), paths.end());
+    return;
+  }
+  if (Stopped() || DirtyDone()) return;
+  // Batches don't overlap but the queued ones may interleave with one another, so sort to let
+  // StartDirtyScan() group them by Repo shard.
+  StrSort(paths.begin(), paths.end(), git_index_is_case_sensitive(git_index_));
+  LOG(DEBUG) << "Found " << paths.size() << " dirty candidate(s) spanning from "
+             << Print(paths.front()) << " to " << Print(paths.back());
+  // Scheduling under the lock guarantees that nothing gets scheduled after GetIndexStats()
+  // has returned.
+  StartDirtyScan(paths);
+}
+
+bool Repo::DirtyDone() const {
+  return Load(unstaged_) >= lim_.max_num_unstaged && Load(untracked_) >= lim_.max_num_untracked;
+}
+
+bool Repo::Untracked(const IndexFile& file, const char* path) {
+  // Ignored candidates have been dropped by the workdir scan.
+  if (!lim_.max_num_untracked) return false;
+  // Tracked directories show up as candidates when they can't be read. Paths with only
+  // conflicting entries have no stage 0 entry.
+  if (file.Tracked(path)) return false;
+  // Whether an untracked directory is reported depends on its content.
+  StringView p(path);
+  if (p.len && p.ptr[p.len - 1] == '/') return false;
+  struct stat st;
+  if (lstat((git_repository_workdir(repo_) + std::string(path)).c_str(), &st)) return false;
+  return S_ISREG(st.st_mode) || S_ISLNK(st.st_mode);
+}
+
+int Repo::OnDirtyDelta(const git_diff_delta& d) {
+  if (d.status == GIT_DELTA_UNTRACKED) {
+    return OnDelta("untracked", d, untracked_, lim_.max_num_untracked, unstaged_,
+                   lim_.max_num_unstaged);
+  }
+  if (d.status == GIT_DELTA_DELETED) Inc(unstaged_deleted_);
+  return OnDelta("unstaged", d, unstaged_, lim_.max_num_unstaged, untracked_,
+                 lim_.max_num_untracked);
+}
+
+int Repo::OnStagedDelta(const git_diff_delta& d) {
+  if (d.status == GIT_DELTA_CONFLICTED) {
+    return OnDelta("conflicted", d, conflicted_, lim_.max_num_conflicted, staged_,
+                   lim_.max_num_staged);
+  }
+  if (d.status == GIT_DELTA_ADDED) Inc(staged_new_);
+  if (d.status == GIT_DELTA_DELETED) Inc(staged_deleted_);
+  return OnDelta("staged", d, staged_, lim_.max_num_staged, conflicted_, lim_.max_num_conflicted);
+}
+
+bool Repo::IndexMatches() const {
+  if (!index_) return false;
+  const IndexFile* file = index_->file();
+  return !file || git_oid_equal(&file->checksum(), git_index_checksum(git_index_));
+}
+
+void Repo::StartCount(bool no_head) {
+  for (const Shard& shard : shards_) {
+    RunAsync(staged_inflight_, [this, shard, no_head] {
+      size_t skip_worktree = 0;
+      size_t assume_unchanged = 0;
+      size_t intent_to_add = 0;
+      for (size_t i = shard.start_i; i != shard.end_i; ++i) {
+        const git_index_entry* entry = git_index_get_byindex_no_sort(git_index_, i);
+        if (entry->flags_extended & GIT_INDEX_ENTRY_SKIP_WORKTREE) ++skip_worktree;
+        if (entry->flags_extended & GIT_INDEX_ENTRY_INTENT_TO_ADD) ++intent_to_add;
+        if (entry->flags & GIT_INDEX_ENTRY_VALID) ++assume_unchanged;
+      }
+      Inc(skip_worktree_, skip_worktree);
+      Inc(assume_unchanged_, assume_unchanged);
+      Inc(intent_to_add_, intent_to_add);
+      if (no_head) {
+        size_t staged = shard.end_i - shard.start_i - intent_to_add;
+        Inc(staged_, staged);
+        Inc(staged_new_, staged);
+      }
+    });
+  }
+}
+
 void Repo::StartStagedScan(const git_oid* head) {
   git_commit* commit = nullptr;
   VERIFY(!git_commit_lookup(&commit, repo_, head)) << GitError();
   ON_SCOPE_EXIT(=) { git_commit_free(commit); };
+
+  // Both the cache tree and the entries of our own parse describe git_index_ only if the latter
+  // was loaded from the same file. Otherwise staged changes would be counted against a stale
+  // index and cached until HEAD changes.
+  const IndexFile* file = IndexMatches() ? index_->file() : nullptr;
+  const CacheTree* cache_tree = file ? file->cache_tree() : nullptr;
+  // Directories whose index entries match HEAD. Shards that lie entirely within one of them are
+  // skipped.
+  std::vector<std::string> unchanged;
   git_tree* tree = nullptr;
-  VERIFY(!git_commit_tree(&tree, commit)) << GitError();
+  if (cache_tree && cache_tree->Matches(*git_commit_tree_id(commit))) {
+    LOG(INFO) << "Cache tree matches HEAD: no staged changes";
+    unchanged.emplace_back();
+  } else {
+    VERIFY(!git_commit_tree(&tree, commit)) << GitError();
+  }
+
+  // Our own comparator needs the index in git order.
+  if (tree && file && file->case_sensitive()) {
+    std::shared_ptr<git_tree> root(tree, git_tree_free);
+    auto diff = std::make_shared<TreeDiff>(repo_, *file, [this](const git_diff_delta& delta) {
+      return !Stopped() && OnStagedDelta(delta) != GIT_EUSER;
+    });
+    RunAsync(staged_inflight_, [this, diff, root] {
+      diff->Run(root.get(), [this, diff](std::function<void()> task) {
+        RunAsync(staged_inflight_, [diff, task = std::move(task)] { task(); });
+      });
+    });
+    return;
+  }
+
+  if (tree && cache_tree) {
+    unchanged = UnchangedDirs(repo_, tree, *cache_tree);
+    LOG(INFO) << "Cache tree matches HEAD in " << unchanged.size() << " director(ies)";
+  }
 
   git_diff_options opt = GIT_DIFF_OPTIONS_INIT;
   opt.flags = GIT_DIFF_EXEMPLARS | GIT_DIFF_INCLUDE_TYPECHANGE_TREES;
@@ -336,29 +687,33 @@ void Repo::StartStagedScan(const git_oid* head) {
   opt.notify_cb = +[](const git_diff* diff, const git_diff_delta* delta,
                       const char* matched_pathspec, void* payload) -> int {
     Repo* repo = static_cast<Repo*>(payload);
-    if (Load(repo->error_)) return GIT_EUSER;
-    if (delta->status == GIT_DELTA_CONFLICTED) {
-      return repo->OnDelta("conflicted", *delta, repo->conflicted_, repo->lim_.max_num_conflicted,
-                           repo->staged_, repo->lim_.max_num_staged);
-    } else {
-      if (delta->status == GIT_DELTA_ADDED) Inc(repo->staged_new_);
-      if (delta->status == GIT_DELTA_DELETED) Inc(repo->staged_deleted_);
-      return repo->OnDelta("staged", *delta, repo->staged_, repo->lim_.max_num_staged,
-                           repo->conflicted_, repo->lim_.max_num_conflicted);
-    }
+    if (repo->Stopped()) return GIT_EUSER;
+    return repo->OnStagedDelta(*delta);
+  };
+  opt.progress_cb = +[](const git_diff* diff, const char* old_path, const char* new_path,
+                        void* payload) -> int {
+    return static_cast<Repo*>(payload)->Stopped() ? GIT_EUSER : 0;
+  };
+
+  // True if all paths in the shard are under the same unchanged directory. Unchanged
+  // directories don't nest, so the only candidate is the last one not greater than start_s.
+  auto Covered = [&](const Shard& shard) {
+    auto it = std::upper_bound(unchanged.begin(), unchanged.end(), shard.start_s);
+    if (it == unchanged.begin()) return false;
+    StringView dir(*--it);
+    return StringView(shard.start_s).StartsWith(dir) &&
+           (shard.end_s.empty() ? !dir.len : StringView(shard.end_s).StartsWith(dir));
   };
 
   for (const Shard& shard : shards_) {
-    RunAsync([this, tree, opt, shard]() mutable {
-      size_t skip_worktree = 0;
-      size_t assume_unchanged = 0;
-      for (size_t i = shard.start_i; i != shard.end_i; ++i) {
-        const git_index_entry* entry = git_index_get_byindex_no_sort(git_index_, i);
-        if (entry->flags_extended & GIT_INDEX_ENTRY_SKIP_WORKTREE) ++skip_worktree;
-        if (entry->flags & GIT_INDEX_ENTRY_VALID) ++assume_unchanged;
+    const bool covered = Covered(shard);
+    RunAsync(staged_inflight_, [this, tree, opt, shard, covered]() mutable {
+      if (covered) {
+        LOG(DEBUG) << "Cache tree matches HEAD from " << Print(shard.start_s) << " to "
+                   << Print(shard.end_s);
+        return;
       }
-      Inc(skip_worktree_, skip_worktree);
-      Inc(assume_unchanged_, assume_unchanged);
+      CHECK(tree);
       opt.range_start = shard.start_s.c_str();
       opt.range_end = shard.end_s.c_str();
       git_diff* diff = nullptr;
@@ -446,19 +801,51 @@ void Repo::UpdateShards() {
   }
 }
 
+std::unique_ptr<IndexFile> Repo::ReadIndexFile(bool case_sensitive) {
+  std::string path = git_repository_path(repo_) + std::string("index");
+  struct stat st;
+  if (stat(path.c_str(), &st) || StatEq(st, index_file_stat_)) return nullptr;
+  index_file_stat_ = st;
+  return IndexFile::Read(path, case_sensitive);
+}
+
+std::shared_ptr<const FsmonitorChanges> Repo::QueryFsmonitor(git_config* cfg, Time deadline) {
+  const IndexFile* file = index_->file();
+  if (!file || !file->fsmonitor_version()) return nullptr;
+  // Paths reported by the hook are compared byte by byte.
+  if (!index_->caps().case_sensitive) return nullptr;
+
+  git_buf buf = {};
+  ON_SCOPE_EXIT(&) { git_buf_free(&buf); };
+  if (git_config_get_string_buf(&buf, cfg, "core.fsmonitor")) return nullptr;
+  std::string hook(buf.ptr, buf.size);
+  // A boolean value means git's builtin fsmonitor daemon, which we cannot talk to.
+  int val;
+  if (hook.empty() || !git_config_parse_bool(&val, hook.c_str())) return nullptr;
+
+  return gitstatus::QueryFsmonitor(hook, git_repository_workdir(repo_),
+                                   file->fsmonitor_version(), file->fsmonitor_token(), deadline);
+}
+
 void Repo::DecInflight() {
   std::unique_lock<std::mutex> lock(mutex_);
   CHECK(Load(inflight_) > 0);
   if (Dec(inflight_) == 1) cv_.notify_one();
 }
 
-void Repo::RunAsync(std::function<void()> f) {
+void Repo::RunAsync(std::atomic<size_t>& phase, std::function<void()> f) {
   Inc(inflight_);
+  Inc(phase);
   try {
-    GlobalThreadPool()->Schedule([this, f = std::move(f)] {
+    GlobalThreadPool()->Schedule([this, &phase, f = std::move(f)] {
       try {
-        ON_SCOPE_EXIT(&) { DecInflight(); };
-        f();
+        ON_SCOPE_EXIT(&) {
+          // Release pairs with the acquire in GetIndexStats(): once the phase counter is seen
+          // as zero, all counters updated by its tasks are final.
+          phase.fetch_sub(1, std::memory_order_release);
+          DecInflight();
+        };
+        if (!Stopped()) f();
       } catch (const Exception&) {
         if (!Load(error_)) {
           std::unique_lock<std::mutex> lock(mutex_);
@@ -470,28 +857,84 @@ void Repo::RunAsync(std::function<void()> f) {
       }
     });
   } catch (...) {
+    Dec(phase);
     DecInflight();
     throw;
   }
 }
 
-void Repo::Wait() {
+bool Repo::Wait(Time deadline) {
   std::unique_lock<std::mutex> lock(mutex_);
-  while (inflight_) cv_.wait(lock);
+  while (inflight_) {
+    if (deadline == Time::max()) {
+      cv_.wait(lock);
+    } else if (cv_.wait_until(lock, deadline) == std::cv_status::timeout) {
+      return !inflight_;
+    }
+  }
+  return true;
+}
+
+size_t Repo::MemoryUsage() {
+  // A rough average over real repos: git_index_entry plus path and libgit2 bookkeeping.
+  constexpr size_t kBytesPerIndexEntry = 160;
+
+  if (!Load(inflight_) && !(index_ && index_->Scanning())) {
+    index_bytes_ = index_ ? index_->MemoryUsage() : 0;
+  }
+  size_t res = index_bytes_ + common_->tag_db().MemoryUsage() / common_.use_count() +
+               verified_.MemoryUsage() + ignore_.MemoryUsage();
+  if (git_index_) res += git_index_entrycount(git_index_) * kBytesPerIndexEntry;
+  return res;
+}
+
+const std::vector<std::string>& Repo::Gitlinks() {
+  if (!git_index_) {
+    gitlinks_.clear();
+    has_gitlinks_ = false;
+    return gitlinks_;
+  }
+  const git_oid* checksum = git_index_checksum(git_index_);
+  if (has_gitlinks_ && git_oid_equal(&gitlinks_checksum_, checksum)) return gitlinks_;
+  gitlinks_.clear();
+  for (size_t i = 0, n = git_index_entrycount(git_index_); i != n; ++i) {
+    const git_index_entry* entry = git_index_get_byindex_no_sort(git_index_, i);
+    if (entry->mode == GIT_FILEMODE_COMMIT && !GIT_INDEX_ENTRY_STAGE(entry)) {
+      gitlinks_.push_back(entry->path);
+    }
+  }
+  gitlinks_checksum_ = *checksum;
+  has_gitlinks_ = true;
+  return gitlinks_;
+}
+
+void Repo::Shrink() {
+  Wait();
+  if (index_) {
+    index_->Wait();
+    index_.reset();
+  }
+  // Otherwise ReadIndexFile() would skip the unchanged file and the rebuilt index_ would have no
+  // IndexFile until the file changes.
+  index_file_stat_ = {};
+  index_bytes_ = 0;
+  if (common_.use_count() == 1) common_->tag_db().Shrink();
 }
 
-std::future<std::string> Repo::GetTagName(const git_oid* target) {
-  auto* promise = new std::promise<std::string>;
-  std::future<std::string> res = promise->get_future();
+std::future<TagName> Repo::GetTagName(const git_oid* target, Time deadline) {
+  auto* promise = new std::promise<TagName>;
+  std::future<TagName> res = promise->get_future();
 
   GlobalThreadPool()->Schedule([=] {
     ON_SCOPE_EXIT(&) { delete promise; };
     if (!target) {
-      promise->set_value("");
+      promise->set_value(TagName());
       return;
     }
     try {
-      promise->set_value(tag_db_.TagForCommit(*target));
+      TagName tag;
+      tag.complete = common_->tag_db().TagForCommit(*target, deadline, tag.name);
+      promise->set_value(std::move(tag));
     } catch (const Exception&) {
       promise->set_exception(std::current_exception());
     }
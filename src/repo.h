@@ -38,11 +38,14 @@
 #include <utility>
 #include <vector>
 
+#include "cancellation.h"
 #include "check.h"
+#include "common_dir.h"
+#include "fsmonitor.h"
+#include "ignore.h"
 #include "index.h"
 #include "options.h"
 #include "string_cmp.h"
-#include "tag_db.h"
 #include "time.h"
 
 namespace gitstatus {
@@ -58,22 +61,58 @@ struct IndexStats {
   size_t num_unstaged_deleted = 0;
   size_t num_skip_worktree = 0;
   size_t num_assume_unchanged = 0;
+  // If false, the deadline passed before the corresponding scan finished. Staged counters are
+  // num_staged, num_conflicted, num_staged_new, num_staged_deleted, num_skip_worktree and
+  // num_assume_unchanged. Dirty counters are num_unstaged, num_untracked and
+  // num_unstaged_deleted.
+  bool staged_complete = true;
+  bool dirty_complete = true;
+};
+
+struct TagName {
+  // If false, the deadline passed before all tags were checked and `name` is empty.
+  bool complete = true;
+  std::string name;
 };
 
 class Repo {
  public:
-  explicit Repo(git_repository* repo, Limits lim);
+  // `common` must be the state of git_repository_commondir(repo). It may be shared with other
+  // worktrees.
+  explicit Repo(git_repository* repo, Limits lim, std::shared_ptr<CommonDir> common);
   Repo(Repo&& other) = delete;
   ~Repo();
 
   git_repository* repo() const { return repo_; }
 
   // Head can be null, in which case has_staged will be false.
-  IndexStats GetIndexStats(const git_oid* head, git_config* cfg);
+  //
+  // If the deadline passes before the scans finish, returns whatever is known and lets the
+  // scans run to completion in the background. The next call picks up their results.
+  //
+  // If `cancel` fires, the scans stop early and the returned stats are meaningless.
+  IndexStats GetIndexStats(const git_oid* head, git_config* cfg, Time deadline = Time::max(),
+                           Cancellation cancel = {});
 
   // Returns the last tag in lexicographical order whose target is equal to the given, or an
   // empty string. Target can be null, in which case the tag is empty.
-  std::future<std::string> GetTagName(const git_oid* target);
+  std::future<TagName> GetTagName(const git_oid* target, Time deadline = Time::max());
+
+  // Returns the paths of submodules (gitlinks) in the index as of the last call to
+  // GetIndexStats(), or nothing if it has never been called. The list is computed once per index
+  // checksum.
+  const std::vector<std::string>& Gitlinks();
+
+  // Approximate number of bytes of heap memory owned by the repo, including an estimate for
+  // the index loaded by libgit2. Tags shared with other worktrees are split evenly between them.
+  // Must not be called concurrently with GetTagName(). If scans abandoned on deadline are still
+  // running, the last measurement of the directory index is used.
+  size_t MemoryUsage();
+
+  // Frees memory that can be rebuilt from disk: the directory index and parsed tags. Tags are
+  // freed only if no other worktree shares them. The repository stays open and the cached
+  // staged counters remain valid.
+  void Shrink();
 
  private:
   struct Shard {
@@ -86,29 +125,101 @@ class Repo {
 
   void UpdateShards();
 
+  // Returns a native parse of the index file, or null if the file hasn't changed since the last
+  // call or cannot be parsed natively.
+  std::unique_ptr<IndexFile> ReadIndexFile(bool case_sensitive);
+
+  // Asks the fsmonitor hook from core.fsmonitor which files have changed since index_ was
+  // written. Returns null if there is no hook or it can't be used with index_.
+  std::shared_ptr<const FsmonitorChanges> QueryFsmonitor(git_config* cfg, Time deadline);
+
   int OnDelta(const char* type, const git_diff_delta& d, std::atomic<size_t>& c1, size_t m1,
               const std::atomic<size_t>& c2, size_t m2);
 
+  // Receives dirty candidates from the directory index. Queues them until GetIndexStats() is
+  // ready to verify them and passes them to StartDirtyScan() afterwards.
+  void OnCandidates(std::vector<const char*> paths);
+
+  // True if the limits on unstaged and untracked files have been reached, so that there is no
+  // point in scanning workdir any further.
+  bool DirtyDone() const;
+
+  // Records the files among `paths` that libgit2 has compared and not found `dirty` in verified_.
+  // `checked_at` is the wall time from before the comparison.
+  void RememberClean(const IndexFile& file, const std::vector<const char*>& paths,
+                     std::vector<std::string> dirty, time_t checked_at);
+
+  // Returns true if the dirty candidate is an untracked file that git would report. If false,
+  // libgit2 has to decide.
+  bool Untracked(const IndexFile& file, const char* path);
+
+  // Counts a delta between the index and workdir. Returns the same as OnDelta().
+  int OnDirtyDelta(const git_diff_delta& d);
+
+  // Counts a delta between HEAD and the index. Returns the same as OnDelta().
+  int OnStagedDelta(const git_diff_delta& d);
+
+  // Compares HEAD with the index. Uses TreeDiff if index_ comes from a case-sensitive
+  // IndexFile and git_diff_tree_to_index() otherwise.
   void StartStagedScan(const git_oid* head);
+
+  // Counts skip-worktree, assume-unchanged and intent-to-add entries in git_index_, one task per
+  // shard. If `no_head` is true, also counts the other entries as staged new files.
+  void StartCount(bool no_head);
+
+  // True if index_ has the same entries as git_index_: it has been built either from the same
+  // file or from git_index_ itself, which hasn't been reloaded since.
+  bool IndexMatches() const;
   void StartDirtyScan(const std::vector<const char*>& paths);
 
+  // True if the scans should stop early because one of them failed or the request has been
+  // cancelled.
+  bool Stopped() const { return error_.load(std::memory_order_relaxed) || cancel_.Cancelled(); }
+
   void DecInflight();
-  void RunAsync(std::function<void()> f);
-  void Wait();
+  void RunAsync(std::atomic<size_t>& phase, std::function<void()> f);
+  // Returns false if the deadline passes before all tasks finish.
+  bool Wait(Time deadline = Time::max());
 
+  // Limits from the command line. lim_ is derived from them by applying git config overrides.
+  const Limits base_lim_;
   Limits lim_;
   git_repository* const repo_;
   git_index* git_index_ = nullptr;
   std::vector<Shard> shards_;
   git_oid head_ = {};
-  TagDb tag_db_;
+  std::shared_ptr<CommonDir> common_;
 
   std::unique_ptr<Index> index_;
+  size_t index_bytes_ = 0;
+  // stat() of the index file as of the last ReadIndexFile() that tried to parse it.
+  struct stat index_file_stat_ = {};
+  // Files found clean by content even though their stat doesn't match the index.
+  VerifiedFiles verified_;
+  // Compiled gitignore files for classifying untracked candidates without libgit2.
+  IgnoreCache ignore_;
+  // UntrackedCache::ignore_files of the listings that index_ has been seeded with.
+  std::vector<std::pair<std::string, struct stat>> seed_ignore_files_;
+  // Gitlinks() of git_index_ with checksum gitlinks_checksum_.
+  std::vector<std::string> gitlinks_;
+  git_oid gitlinks_checksum_ = {};
+  bool has_gitlinks_ = false;
+
+  std::mutex candidates_mutex_;
+  // True while GetIndexStats() accepts dirty candidates for verification.
+  bool streaming_ = false;
+  // Candidates that have arrived while streaming_ was false.
+  std::vector<const char*> pending_;
 
   std::mutex mutex_;
   std::condition_variable cv_;
   std::atomic<size_t> inflight_{0};
+  // The number of unfinished tasks started by StartStagedScan() and StartDirtyScan().
+  std::atomic<size_t> staged_inflight_{0};
+  std::atomic<size_t> dirty_inflight_{0};
   std::atomic<bool> error_{false};
+  // Cancellation of the request for which the current scans are running.
+  Cancellation cancel_;
   std::atomic<size_t> staged_{0};
   std::atomic<size_t> unstaged_{0};
   std::atomic<size_t> conflicted_{0};
@@ -118,6 +229,10 @@ class Repo {
   std::atomic<size_t> unstaged_deleted_{0};
   std::atomic<size_t> skip_worktree_{0};
   std::atomic<size_t> assume_unchanged_{0};
+  std::atomic<size_t> intent_to_add_{0};
+  // True if skip_worktree_, assume_unchanged_ and intent_to_add_ have been counted since
+  // git_index_ was last loaded.
+  bool counted_ = false;
   std::atomic<Tribool> untracked_cache_{Tribool::kUnknown};
 };
 
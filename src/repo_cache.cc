@@ -17,12 +17,17 @@
 
 #include "repo_cache.h"
 
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 
 #include "check.h"
 #include "git.h"
 #include "print.h"
 #include "scope_guard.h"
+#include "stat.h"
 #include "string_view.h"
 
 namespace gitstatus {
@@ -81,13 +86,82 @@ std::string DirName(std::string path) {
   return path;
 }
 
+// Returns true if `x` and `y` describe the same file system entry and it hasn't been modified.
+// Directories are compared by identity alone because git bumps their mtime whenever it creates
+// a lock file in them.
+bool SameEntry(const struct stat& x, const struct stat& y) {
+  if (x.st_dev != y.st_dev || x.st_ino != y.st_ino || x.st_mode != y.st_mode) return false;
+  return S_ISDIR(x.st_mode) || StatEq(x, y);
+}
+
+std::string WithSlash(std::string path) {
+  if (path.empty() || path.back() != '/') path += '/';
+  return path;
+}
+
+// The discovery cache is cleared when it grows this large.
+constexpr size_t kMaxDiscoveries = 1 << 10;
+
 }  // namespace
 
+bool RepoCache::Rediscover(const std::string& key, const std::string& dir, bool from_dotgit,
+                           std::string& gitdir, std::string& workdir) {
+  auto it = discovery_.find(key);
+  if (it == discovery_.end()) return false;
+  const Discovery& d = it->second;
+
+  // The gitdir/workdir pair is validated along with `dir/.git`, which catches `git init` and
+  // `git submodule update --init` in the current directory. A .git created since then in a
+  // directory strictly between `dir` and workdir goes unnoticed until the entry is evicted.
+  // Checking for it would cost a stat per directory on every request.
+  struct stat st;
+  bool valid = !stat(d.anchor.c_str(), &st) && SameEntry(st, d.anchor_stat);
+  // When `dir` is GIT_DIR, it's the anchor. Otherwise it must still exist: discovery fails for
+  // a directory that has been deleted.
+  if (valid && !from_dotgit) valid = !stat(dir.c_str(), &st) && S_ISDIR(st.st_mode);
+  if (valid && !from_dotgit && WithSlash(dir) != d.workdir) {
+    valid = lstat((WithSlash(dir) + ".git").c_str(), &st) && errno == ENOENT;
+  }
+  if (!valid) {
+    discovery_.erase(it);
+    return false;
+  }
+
+  gitdir = d.gitdir;
+  workdir = d.workdir;
+  return true;
+}
+
+void RepoCache::Remember(std::string key, const std::string& dir, bool from_dotgit,
+                         const std::string& gitdir, const std::string& workdir) {
+  Discovery d;
+  if (from_dotgit) {
+    d.anchor = dir;
+  } else {
+    // Only the common layout can be validated cheaply: `dir` is within workdir, and workdir/.git
+    // is either gitdir or a file pointing to it. Anything else (symlinks in `dir`,
+    // core.worktree, etc.) goes through the full search every time.
+    if (WithSlash(dir).compare(0, workdir.size(), workdir)) return;
+    d.anchor = workdir + ".git";
+  }
+  if (stat(d.anchor.c_str(), &d.anchor_stat)) return;
+  if (!from_dotgit && S_ISDIR(d.anchor_stat.st_mode) && d.anchor + '/' != gitdir) return;
+
+  d.gitdir = gitdir;
+  d.workdir = workdir;
+  if (discovery_.size() >= kMaxDiscoveries) discovery_.clear();
+  discovery_[std::move(key)] = std::move(d);
+}
+
 Repo* RepoCache::Open(const std::string& dir, bool from_dotgit) {
   if (dir.empty() || dir.front() != '/') return nullptr;
 
+  std::string key = (from_dotgit ? ':' : '/') + dir;
   std::string gitdir, workdir;
-  GitDirs(dir.c_str(), from_dotgit, gitdir, workdir);
+  if (!Rediscover(key, dir, from_dotgit, gitdir, workdir)) {
+    GitDirs(dir.c_str(), from_dotgit, gitdir, workdir);
+    if (!gitdir.empty()) Remember(std::move(key), dir, from_dotgit, gitdir, workdir);
+  }
   if (gitdir.empty()) {
     // This isn't quite correct because of differences in canonicalization, .git files and GIT_DIR.
     // A proper solution would require tracking the "discovery dir" for every repository and
@@ -109,6 +183,8 @@ Repo* RepoCache::Open(const std::string& dir, bool from_dotgit) {
   if (it != cache_.end()) {
     lru_.erase(it->second->lru);
     it->second->lru = lru_.insert({Clock::now(), it});
+    it->second->shrunk = false;
+    Use(it->second.get());
     return it->second.get();
   }
 
@@ -131,20 +207,31 @@ Repo* RepoCache::Open(const std::string& dir, bool from_dotgit) {
   } else {
     LOG(INFO) << "Initializing new repository: " << Print(gitdir);
 
-    // Libgit2 initializes odb and refdb lazily with double-locking. To avoid useless work
-    // when multiple threads attempt to initialize the same db at the same time, we trigger
-    // initialization manually before threads are in play.
-    git_odb* odb;
-    VERIFY(!git_repository_odb(&odb, repo)) << GitError();
-    git_odb_free(odb);
+    const char* commondir = git_repository_commondir(repo);
+    VERIFY(commondir && *commondir);
+    std::weak_ptr<CommonDir>& weak = common_dirs_[commondir];
+    std::shared_ptr<CommonDir> common = weak.lock();
+    if (!common) {
+      LOG(INFO) << "Initializing new common dir: " << Print(commondir);
+      common = std::make_shared<CommonDir>(commondir);
+      weak = common;
+    }
+
+    // Adopting the shared odb must happen before anything reads objects through `repo`.
+    VERIFY(!git_repository_set_odb(repo, common->odb())) << GitError();
 
+    // Libgit2 initializes refdb lazily with double-locking. To avoid useless work when multiple
+    // threads attempt to initialize it at the same time, we trigger initialization manually
+    // before threads are in play.
     git_refdb* refdb;
     VERIFY(!git_repository_refdb(&refdb, repo)) << GitError();
     git_refdb_free(refdb);
 
-    elem = std::make_unique<Entry>(std::exchange(repo, nullptr), lim_);
+    elem = std::make_unique<Entry>(std::exchange(repo, nullptr), lim_, std::move(common));
   }
   elem->lru = lru_.insert({Clock::now(), x.first});
+  elem->shrunk = false;
+  Use(elem.get());
   return elem.get();
 }
 
@@ -157,11 +244,68 @@ void RepoCache::Free(Time cutoff) {
   }
 }
 
+void RepoCache::Use(Entry* entry) {
+  if (entry->used) return;
+  entry->used = true;
+  used_.push_back(entry);
+}
+
+void RepoCache::Trim() {
+  ON_SCOPE_EXIT(&) {
+    for (Entry* entry : used_) entry->used = false;
+    used_.clear();
+  };
+  if (max_bytes_ == static_cast<size_t>(-1) || used_.empty()) return;
+
+  for (Entry* entry : used_) {
+    total_bytes_ -= entry->bytes;
+    entry->bytes = entry->MemoryUsage();
+    total_bytes_ += entry->bytes;
+  }
+  if (total_bytes_ <= max_bytes_) return;
+
+  LOG(INFO) << "Repository cache takes approximately " << total_bytes_ << " bytes; the budget is "
+            << max_bytes_;
+
+  // Shrink before closing. A shrunk repo is much cheaper to bring back than a closed one.
+  for (const auto& kv : lru_) {
+    if (total_bytes_ <= max_bytes_) return;
+    Entry* entry = kv.second->second.get();
+    if (entry->used || entry->shrunk) continue;
+    LOG(INFO) << "Shrinking repository: " << Print(kv.second->first);
+    entry->Shrink();
+    entry->shrunk = true;
+    total_bytes_ -= entry->bytes;
+    entry->bytes = entry->MemoryUsage();
+    total_bytes_ += entry->bytes;
+  }
+
+  while (total_bytes_ > max_bytes_ && !lru_.begin()->second->second->used) {
+    Erase(lru_.begin()->second);
+  }
+}
+
 void RepoCache::Erase(Cache::iterator it) {
-  if (it == cache_.end()) return;
+  // Repos used by the current request may still be referenced by the caller.
+  if (it == cache_.end() || it->second->used) return;
   LOG(INFO) << "Closing repository: " << Print(it->first);
+  total_bytes_ -= it->second->bytes;
   lru_.erase(it->second->lru);
+  for (auto d = discovery_.begin(); d != discovery_.end();) {
+    if (d->second.gitdir == it->first) {
+      d = discovery_.erase(d);
+    } else {
+      ++d;
+    }
+  }
   cache_.erase(it);
+  for (auto c = common_dirs_.begin(); c != common_dirs_.end();) {
+    if (c->second.expired()) {
+      c = common_dirs_.erase(c);
+    } else {
+      ++c;
+    }
+  }
 }
 
 }  // namespace gitstatus
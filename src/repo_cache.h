@@ -23,9 +23,13 @@
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
+
+#include <sys/stat.h>
 
 #include <git2.h>
 
+#include "common_dir.h"
 #include "options.h"
 #include "repo.h"
 #include "time.h"
@@ -34,25 +38,70 @@ namespace gitstatus {
 
 class RepoCache {
  public:
-  explicit RepoCache(Limits lim) : lim_(std::move(lim)) {}
+  // Approximate memory used by cached repos is kept under `max_bytes`.
+  RepoCache(Limits lim, size_t max_bytes) : lim_(std::move(lim)), max_bytes_(max_bytes) {}
+  // The returned repo stays open at least until the next call to Trim(), even if a later Open()
+  // fails to discover it.
   Repo* Open(const std::string& dir, bool from_dotgit);
   void Free(Time cutoff);
 
+  // Measures the memory used by the repos returned by Open() since the last call. Then, if the
+  // total is over the budget, shrinks least recently used repos and, if that's not enough,
+  // closes them. The repos opened since the last call are never shrunk or closed. Must not be
+  // called while a request is being processed.
+  void Trim();
+
+  // Returns the last time the least recently used repo was opened, or Time::max() if the cache
+  // is empty.
+  Time OldestUse() const { return lru_.empty() ? Time::max() : lru_.begin()->first; }
+
  private:
   struct Entry;
   using Cache = std::unordered_map<std::string, std::unique_ptr<Entry>>;
   using LRU = std::multimap<Time, Cache::iterator>;
 
+  // Where a request directory was last discovered to belong.
+  struct Discovery {
+    std::string gitdir;
+    std::string workdir;
+    // Either workdir + ".git" or GIT_DIR. Its identity is checked on every lookup.
+    std::string anchor;
+    struct stat anchor_stat;
+  };
+
   void Erase(Cache::iterator it);
+  void Use(Entry* entry);
+
+  // Fills `gitdir` and `workdir` from the discovery cache if the cached entry is still valid.
+  // Costs at most three stat calls.
+  bool Rediscover(const std::string& key, const std::string& dir, bool from_dotgit,
+                  std::string& gitdir, std::string& workdir);
+  void Remember(std::string key, const std::string& dir, bool from_dotgit,
+                const std::string& gitdir, const std::string& workdir);
 
   Limits lim_;
+  size_t max_bytes_;
+  size_t total_bytes_ = 0;
   Cache cache_;
   LRU lru_;
+  std::unordered_map<std::string, Discovery> discovery_;
+  // Keyed by git_repository_commondir(). Linked worktrees of the same repository share one.
+  std::unordered_map<std::string, std::weak_ptr<CommonDir>> common_dirs_;
 
   struct Entry : Repo {
     using Repo::Repo;
     LRU::iterator lru;
+    // The last measurement of MemoryUsage().
+    size_t bytes = 0;
+    // True if Shrink() has been called and the repo hasn't been used since.
+    bool shrunk = false;
+    // True if the repo is in used_.
+    bool used = false;
   };
+
+  // Repos returned by Open() since the last call to Trim(). A request opens several of them when
+  // it scans submodules.
+  std::vector<Entry*> used_;
 };
 
 }  // namespace gitstatus
@@ -17,14 +17,18 @@
 
 #include "request.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
-#include <sys/select.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 #include "check.h"
@@ -36,24 +40,61 @@ namespace gitstatus {
 
 namespace {
 
-Request ParseRequest(const std::string& s) {
+Request ParseRequest(StringView msg) {
   Request res;
-  auto begin = s.begin(), end = s.end(), sep = std::find(begin, end, kFieldSep);
-  VERIFY(sep != end) << "Malformed request: " << s;
-  res.id.assign(begin, sep);
+  const char* const end = msg.ptr + msg.len;
+  const char* pos = msg.ptr;
+  StringView field;
 
-  begin = sep + 1;
-  if (*begin == ':') {
+  // Sets `field` to the next field and returns true. Returns false if there are no more fields.
+  auto Next = [&] {
+    if (!pos) return false;
+    auto* sep = static_cast<const char*>(std::memchr(pos, kFieldSep, end - pos));
+    field = StringView(pos, sep ? sep : end);
+    pos = sep ? sep + 1 : nullptr;
+    return true;
+  };
+
+  Next();
+  VERIFY(pos) << "Malformed request: " << msg;
+  res.id.assign(field.ptr, field.len);
+
+  Next();
+  if (field.StartsWith(":")) {
     res.from_dotgit = true;
-    ++begin;
+    ++field.ptr;
+    --field.len;
   }
-  sep = std::find(begin, end, kFieldSep);
-  res.dir.assign(begin, sep);
-  if (sep == end) return res;
+  res.dir.assign(field.ptr, field.len);
+
+  auto Flag = [&](bool& flag) {
+    if (!Next()) return;
+    VERIFY(field.len == 1 && (*field.ptr == '0' || *field.ptr == '1'))
+        << "Malformed request: " << msg;
+    flag = *field.ptr == '1';
+  };
 
-  begin = sep + 1;
-  VERIFY(begin + 1 == end && (*begin == '0' || *begin == '1')) << "Malformed request: " << s;
-  res.diff = *begin == '0';
+  bool no_diff = false;
+  Flag(no_diff);
+  res.diff = !no_diff;
+  Flag(res.stream);
+
+  if (Next()) {
+    VERIFY(field.len <= 9) << "Malformed request: " << msg;
+    if (field.len) {
+      long ms = 0;
+      for (size_t i = 0; i != field.len; ++i) {
+        char c = field.ptr[i];
+        VERIFY(c >= '0' && c <= '9') << "Malformed request: " << msg;
+        ms = 10 * ms + (c - '0');
+      }
+      res.deadline = Clock::now() + std::chrono::milliseconds(ms);
+    }
+  }
+
+  if (Next()) res.session.assign(field.ptr, field.len);
+
+  VERIFY(!Next()) << "Malformed request: " << msg;
   return res;
 }
 
@@ -72,59 +113,164 @@ std::ostream& operator<<(std::ostream& strm, const Request& req) {
   strm << Print(req.id) << " for " << Print(req.dir);
   if (req.from_dotgit) strm << " [from-dotgit]";
   if (!req.diff) strm << " [no-diff]";
+  if (req.stream) strm << " [stream]";
+  if (req.deadline != Time::max()) {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(req.deadline - Clock::now());
+    strm << " [deadline in " << ms.count() << "ms]";
+  }
+  if (!req.session.empty()) strm << " [session " << Print(req.session) << "]";
   return strm;
 }
 
+ParentWatch::ParentWatch(int lock_fd, int parent_pid) : lock_fd_(lock_fd), parent_pid_(parent_pid) {
+#ifdef SYS_pidfd_open
+  if (parent_pid_ >= 0) {
+    pidfd_ = syscall(SYS_pidfd_open, parent_pid_, 0);
+    if (pidfd_ >= 0) {
+      CHECK(fcntl(pidfd_, F_SETFD, FD_CLOEXEC) != -1) << Errno();
+    } else if (errno == ESRCH) {
+      OnReadable();
+    } else {
+      LOG(INFO) << "pidfd_open is not available; polling parent " << parent_pid_ << ": "
+                << Errno();
+    }
+  }
+#endif
+}
+
+ParentWatch::~ParentWatch() {
+  if (pidfd_ >= 0) CHECK(!close(pidfd_)) << Errno();
+}
+
+int ParentWatch::timeout_ms() const {
+  return lock_fd_ >= 0 || (parent_pid_ >= 0 && pidfd_ < 0) ? 1000 : -1;
+}
+
+void ParentWatch::Check() const {
+  if (lock_fd_ >= 0 && !IsLockedFd(lock_fd_)) {
+    LOG(INFO) << "Lock on fd " << lock_fd_ << " is gone. Exiting.";
+    std::exit(0);
+  }
+  if (parent_pid_ >= 0 && pidfd_ < 0 && kill(parent_pid_, 0)) {
+    LOG(INFO) << "Unable to send signal 0 to " << parent_pid_ << ". Exiting.";
+    std::exit(0);
+  }
+}
+
+void ParentWatch::OnReadable() const {
+  LOG(INFO) << "Parent process " << parent_pid_ << " is gone. Exiting.";
+  std::exit(0);
+}
+
+ssize_t RequestParser::Read(int fd, std::vector<Request>& res) {
+  constexpr size_t kMinRead = 64 << 10;
+
+  if (buf_.size() - end_ < kMinRead) {
+    // Move the incomplete request to the front and grow the buffer if it's still too small.
+    if (begin_) {
+      std::memmove(buf_.data(), buf_.data() + begin_, end_ - begin_);
+      end_ -= begin_;
+      begin_ = 0;
+    }
+    if (buf_.size() - end_ < kMinRead) buf_.resize(std::max(2 * buf_.size(), end_ + kMinRead));
+  }
+
+  ssize_t n = read(fd, buf_.data() + end_, buf_.size() - end_);
+  if (n <= 0) return n;
+
+  // Bytes before end_ have already been searched for separators.
+  char* p = buf_.data() + end_;
+  end_ += n;
+  char* last = buf_.data() + end_;
+  while (char* sep = static_cast<char*>(std::memchr(p, kMsgSep, last - p))) {
+    try {
+      res.push_back(ParseRequest(StringView(buf_.data() + begin_, sep)));
+      res.back().client = client_;
+    } catch (const Exception&) {
+    }
+    p = sep + 1;
+    begin_ = p - buf_.data();
+  }
+  if (begin_ == end_) begin_ = end_ = 0;
+  return n;
+}
+
 RequestReader::RequestReader(int fd, int lock_fd, int parent_pid)
-    : fd_(fd), lock_fd_(lock_fd), parent_pid_(parent_pid) {
+    : fd_(fd),
+      watch_(lock_fd, parent_pid),
+      parser_(std::make_shared<Client>(STDOUT_FILENO, false)) {
   CHECK(fd != lock_fd);
 }
 
-bool RequestReader::ReadRequest(Request& req) {
-  auto eol = std::find(read_.begin(), read_.end(), kMsgSep);
-  if (eol != read_.end()) {
-    std::string msg(read_.begin(), eol);
-    read_.erase(read_.begin(), eol + 1);
-    req = ParseRequest(msg);
-    return true;
-  }
+bool RequestReader::ReadRequests(std::vector<Request>& res) {
+  const size_t orig_size = res.size();
 
-  char buf[256];
   while (true) {
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(fd_, &fds);
-    struct timeval timeout = {.tv_sec = 1};
-
-    int n;
-    CHECK((n = select(fd_ + 1, &fds, NULL, NULL, &timeout)) >= 0) << Errno();
-    if (n == 0) {
-      if (lock_fd_ >= 0 && !IsLockedFd(lock_fd_)) {
-        LOG(INFO) << "Lock on fd " << lock_fd_ << " is gone. Exiting.";
-        std::exit(0);
-      }
-      if (parent_pid_ >= 0 && kill(parent_pid_, 0)) {
-        LOG(INFO) << "Unable to send signal 0 to " << parent_pid_ << ". Exiting.";
-        std::exit(0);
-      }
-      req = {};
-      return false;
+    pollfd fds[2] = {{.fd = fd_, .events = POLLIN}, {.fd = watch_.fd(), .events = POLLIN}};
+    int n = poll(fds, watch_.fd() >= 0 ? 2 : 1, watch_.timeout_ms());
+    if (n < 0 && errno == EINTR) continue;
+    CHECK(n >= 0) << Errno();
+    if (fds[1].revents) watch_.OnReadable();
+    if (!fds[0].revents) {
+      watch_.Check();
+      continue;
     }
 
-    CHECK((n = read(fd_, buf, sizeof(buf))) >= 0) << Errno();
-    if (n == 0) {
-      LOG(INFO) << "EOF. Exiting.";
-      std::exit(0);
+    ssize_t r;
+    CHECK((r = parser_.Read(fd_, res)) >= 0) << Errno();
+    if (r == 0) return false;
+    if (res.size() != orig_size) return true;
+  }
+}
+
+void RequestQueue::Push(Request req) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!req.session.empty()) {
+    for (Request& r : queue_) {
+      if (r.client == req.client && r.session == req.session && !r.cancel.Cancelled()) {
+        LOG(INFO) << "Cancelling queued request: " << r;
+        r.cancel.Cancel();
+      }
     }
-    read_.insert(read_.end(), buf, buf + n);
-    int eol = std::find(buf, buf + n, kMsgSep) - buf;
-    if (eol != n) {
-      std::string msg(read_.begin(), read_.end() - (n - eol));
-      read_.erase(read_.begin(), read_.begin() + msg.size() + 1);
-      req = ParseRequest(msg);
-      return true;
+    if (active_ && last_.client == req.client && last_.session == req.session &&
+        !last_.cancel.Cancelled()) {
+      LOG(INFO) << "Cancelling request in progress: " << last_;
+      last_.cancel.Cancel();
     }
   }
+  queue_.push_back(std::move(req));
+  cv_.notify_one();
+}
+
+bool RequestQueue::Pop(Time deadline, Request& req) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Release the client of the previous request. It may have disconnected.
+  active_ = false;
+  last_ = {};
+  while (queue_.empty()) {
+    if (closed_) return false;
+    if (deadline == Time::max()) {
+      cv_.wait(lock);
+    } else if (cv_.wait_until(lock, deadline) == std::cv_status::timeout && queue_.empty()) {
+      return false;
+    }
+  }
+  req = std::move(queue_.front());
+  queue_.pop_front();
+  last_ = req;
+  active_ = true;
+  return true;
+}
+
+void RequestQueue::Close() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  closed_ = true;
+  cv_.notify_one();
+}
+
+bool RequestQueue::Drained() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return closed_ && queue_.empty();
 }
 
 }  // namespace gitstatus
@@ -18,9 +18,19 @@
 #ifndef ROMKATV_GITSTATUS_REQUEST_H_
 #define ROMKATV_GITSTATUS_REQUEST_H_
 
+#include <sys/types.h>
+
+#include <condition_variable>
 #include <deque>
+#include <memory>
+#include <mutex>
 #include <ostream>
 #include <string>
+#include <vector>
+
+#include "cancellation.h"
+#include "client.h"
+#include "time.h"
 
 namespace gitstatus {
 
@@ -29,20 +39,108 @@ struct Request {
   std::string dir;
   bool from_dotgit = false;
   bool diff = true;
+  // If true, reply with a partial response containing the fields that can be computed without
+  // reading the index before replying with the full response.
+  bool stream = false;
+  // Reply by this time even if some fields are still unknown. Time::max() means no deadline.
+  Time deadline = Time::max();
+  // A newer request from the same client with the same non-empty session cancels this one.
+  std::string session;
+  Cancellation cancel;
+  // Where to write the response.
+  std::shared_ptr<const Client> client;
 };
 
 std::ostream& operator<<(std::ostream& strm, const Request& req);
 
+// Exits the process when the lock on `lock_fd` is gone or when `parent_pid` is gone. Negative
+// values disable the corresponding checks.
+//
+// Where possible, parent death is delivered as an event on fd() so that an idle daemon doesn't
+// need to wake up periodically. Lock fd can only be polled.
+class ParentWatch {
+ public:
+  ParentWatch(int lock_fd, int parent_pid);
+  ParentWatch(ParentWatch&&) = delete;
+  ~ParentWatch();
+
+  // If non-negative, becomes readable when the parent exits. Call OnReadable() then.
+  int fd() const { return pidfd_; }
+
+  // The longest time in milliseconds to wait for I/O before calling Check(). -1 if Check()
+  // doesn't need to be called.
+  int timeout_ms() const;
+
+  // Exits if orphaned.
+  void Check() const;
+
+  // Exits.
+  [[noreturn]] void OnReadable() const;
+
+ private:
+  int lock_fd_;
+  int parent_pid_;
+  int pidfd_ = -1;
+};
+
+// Splits a stream of bytes into requests.
+class RequestParser {
+ public:
+  explicit RequestParser(std::shared_ptr<const Client> client) : client_(std::move(client)) {}
+
+  // Calls read(2) on `fd` once and appends all requests completed by the data to `res`.
+  // Malformed requests are skipped. Returns the result of read(2).
+  ssize_t Read(int fd, std::vector<Request>& res);
+
+ private:
+  std::shared_ptr<const Client> client_;
+  // Bytes in [begin_, end_) have been read but don't form a complete request yet.
+  std::vector<char> buf_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+};
+
+// Reads requests from a single file descriptor. Responses go to stdout.
 class RequestReader {
  public:
   RequestReader(int fd, int lock_fd, int parent_pid);
-  bool ReadRequest(Request& req);
+
+  // Blocks until there is at least one complete request or EOF. Appends all complete requests to
+  // `res`. Malformed requests are skipped. Returns false on EOF.
+  bool ReadRequests(std::vector<Request>& res);
 
  private:
   int fd_;
-  int lock_fd_;
-  int parent_pid_;
-  std::deque<char> read_;
+  ParentWatch watch_;
+  RequestParser parser_;
+};
+
+// Hands requests from the thread that reads them to the thread that processes them.
+class RequestQueue {
+ public:
+  // Does not block. Cancels all queued requests and the request being processed if they have
+  // the same client and session as `req`.
+  void Push(Request req);
+
+  // Blocks until there is a request or the deadline passes. Returns false on timeout or if the
+  // queue is closed and empty, whichever comes first. The request returned by the previous call
+  // is considered processed at this point.
+  bool Pop(Time deadline, Request& req);
+
+  // Tells Pop() to stop waiting once the queue is empty. Push() must not be called afterwards.
+  void Close();
+
+  // True if the queue is closed and empty.
+  bool Drained();
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Request> queue_;
+  bool closed_ = false;
+  // The request returned by the last call to Pop(), if any.
+  bool active_ = false;
+  Request last_;
 };
 
 }  // namespace gitstatus
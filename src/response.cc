@@ -17,9 +17,11 @@
 
 #include "response.h"
 
-#include <cctype>
-#include <cstring>
-#include <iostream>
+#include <errno.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <utility>
 
 #include "check.h"
 #include "serialization.h"
@@ -30,44 +32,104 @@ namespace {
 
 constexpr char kUnreadable = '?';
 
-void SafePrint(std::ostream& strm, StringView s) {
-  for (size_t i = 0; i != s.len; ++i) {
-    char c = s.ptr[i];
-    strm << (c > 127 || std::isprint(c) ? c : kUnreadable);
+// The buffer of the last destroyed ResponseWriter. The next one picks it up.
+thread_local std::string g_spare_buf;
+
+// Replaces non-printable ASCII characters with kUnreadable. Bytes above 127 are left alone.
+// There are no branches in the loop body, which lets the compiler vectorize it.
+void Sanitize(char* p, size_t n) {
+  for (size_t i = 0; i != n; ++i) {
+    char c = p[i];
+    p[i] = c < 32 || c == 127 ? kUnreadable : c;
+  }
+}
+
+// A --socket client may go away without affecting others, so failing to write to it isn't
+// fatal. Failing to write to stdout means that nobody is listening anymore, so the daemon exits
+// the same way it does on EOF in stdin.
+void WriteAll(int fd, const char* p, size_t n) {
+  while (n) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) {
+      if (fd == STDOUT_FILENO) {
+        LOG(INFO) << "Cannot write to stdout: " << Errno() << ". Exiting.";
+        std::exit(0);
+      }
+      LOG(WARN) << "Cannot write response to fd " << fd << ": " << Errno();
+      return;
+    }
+    p += w;
+    n -= w;
   }
 }
 
 }  // namespace
 
-ResponseWriter::ResponseWriter(std::string request_id) : request_id_(std::move(request_id)) {
-  SafePrint(strm_, request_id_);
+ResponseWriter::ResponseWriter(int fd, StringView request_id, Cancellation cancel)
+    : fd_(fd), cancel_(std::move(cancel)), buf_(std::move(g_spare_buf)) {
+  constexpr size_t kInitialCapacity = 4 << 10;
+  buf_.clear();
+  buf_.reserve(kInitialCapacity);
+  buf_.append(request_id.ptr, request_id.len);
+  Sanitize(&buf_[0], buf_.size());
   Print(1);
+  status_pos_ = buf_.size() - 1;
 }
 
 ResponseWriter::~ResponseWriter() {
   if (!done_) {
-    strm_.str("");
-    SafePrint(strm_, request_id_);
-    Print("0");
-    Dump("without git status");
+    // Keep the request ID and overwrite everything after it.
+    buf_.resize(status_pos_);
+    if (cancel_.Cancelled()) {
+      buf_ += '3';
+      Dump("cancelled");
+    } else {
+      buf_ += '0';
+      Dump("without git status");
+    }
   }
+  g_spare_buf = std::move(buf_);
 }
 
 void ResponseWriter::Print(ssize_t val) {
-  strm_ << kFieldSep;
-  strm_ << val;
+  char digits[24];
+  char* end = digits + sizeof(digits);
+  char* p = end;
+  size_t x = val < 0 ? 0 - static_cast<size_t>(val) : val;
+  do {
+    *--p = '0' + x % 10;
+    x /= 10;
+  } while (x);
+  if (val < 0) *--p = '-';
+  buf_ += kFieldSep;
+  buf_.append(p, end);
 }
 
 void ResponseWriter::Print(StringView val) {
-  strm_ << kFieldSep;
-  SafePrint(strm_, val);
+  buf_ += kFieldSep;
+  size_t pos = buf_.size();
+  buf_.append(val.ptr, val.len);
+  Sanitize(&buf_[pos], val.len);
+}
+
+void ResponseWriter::DumpPartial(const char* log) {
+  CHECK(!done_);
+  LOG(INFO) << "Replying " << log;
+  CHECK(buf_[status_pos_] == '1');
+  buf_[status_pos_] = '2';
+  buf_ += kMsgSep;
+  WriteAll(fd_, buf_.data(), buf_.size());
+  buf_.pop_back();
+  buf_[status_pos_] = '1';
 }
 
 void ResponseWriter::Dump(const char* log) {
   CHECK(!done_);
   done_ = true;
   LOG(INFO) << "Replying " << log;
-  std::cout << strm_.str() << kMsgSep << std::flush;
+  buf_ += kMsgSep;
+  WriteAll(fd_, buf_.data(), buf_.size());
 }
 
 }  // namespace gitstatus
@@ -18,31 +18,44 @@
 #ifndef ROMKATV_GITSTATUS_RESPONSE_H_
 #define ROMKATV_GITSTATUS_RESPONSE_H_
 
+#include <sys/types.h>
+
 #include <cstddef>
-#include <cstdint>
-#include <sstream>
 #include <string>
 
+#include "cancellation.h"
 #include "string_view.h"
 
 namespace gitstatus {
 
 class ResponseWriter {
  public:
-  ResponseWriter(std::string request_id);
+  // Writes the response to `fd`, which is not owned.
+  ResponseWriter(int fd, StringView request_id, Cancellation cancel = {});
   ResponseWriter(ResponseWriter&&) = delete;
+  // If Dump() hasn't been called, writes a response without git status. Its status is 3 if
+  // the request has been cancelled and 0 otherwise.
   ~ResponseWriter();
 
   void Print(ssize_t val);
   void Print(StringView val);
   void Print(const char* val) { Print(StringView(val)); }
 
+  // Writes the fields printed so far as a partial response. The full response must still be
+  // written with Dump() afterwards.
+  void DumpPartial(const char* log);
+
   void Dump(const char* log);
 
  private:
+  int fd_;
   bool done_ = false;
-  std::string request_id_;
-  std::ostringstream strm_;
+  // Offset of the "1" that marks a full response; DumpPartial() replaces it with "2".
+  size_t status_pos_;
+  Cancellation cancel_;
+  // The response is serialized here and written to fd_ with a single write() call. The
+  // buffer is recycled between responses, so in steady state there are no allocations.
+  std::string buf_;
 };
 
 }  // namespace gitstatus
@@ -0,0 +1,94 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "sha1.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace gitstatus {
+
+namespace {
+
+inline uint32_t Rol(uint32_t x, int n) { return x << n | x >> (32 - n); }
+
+inline uint32_t Load(const unsigned char* p) {
+  return uint32_t{p[0]} << 24 | uint32_t{p[1]} << 16 | uint32_t{p[2]} << 8 | p[3];
+}
+
+}  // namespace
+
+Sha1::Sha1() : h_{0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0} {}
+
+void Sha1::Compress(const unsigned char* block) {
+  uint32_t w[80];
+  for (int i = 0; i != 16; ++i) w[i] = Load(block + 4 * i);
+  for (int i = 16; i != 80; ++i) w[i] = Rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  uint32_t a = h_[0], b = h_[1], c = h_[2], d = h_[3], e = h_[4];
+  auto Round = [&](uint32_t f, uint32_t k, uint32_t w) {
+    uint32_t t = Rol(a, 5) + f + e + k + w;
+    e = d;
+    d = c;
+    c = Rol(b, 30);
+    b = a;
+    a = t;
+  };
+  for (int i = 0; i != 20; ++i) Round((b & c) | (~b & d), 0x5A827999, w[i]);
+  for (int i = 20; i != 40; ++i) Round(b ^ c ^ d, 0x6ED9EBA1, w[i]);
+  for (int i = 40; i != 60; ++i) Round((b & c) | (b & d) | (c & d), 0x8F1BBCDC, w[i]);
+  for (int i = 60; i != 80; ++i) Round(b ^ c ^ d, 0xCA62C1D6, w[i]);
+
+  h_[0] += a;
+  h_[1] += b;
+  h_[2] += c;
+  h_[3] += d;
+  h_[4] += e;
+}
+
+void Sha1::Update(const void* data, size_t len) {
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  size_t used = len_ % 64;
+  len_ += len;
+  if (used) {
+    size_t n = std::min(len, 64 - used);
+    std::memcpy(buf_ + used, p, n);
+    p += n;
+    len -= n;
+    if (used + n != 64) return;
+    Compress(buf_);
+  }
+  for (; len >= 64; p += 64, len -= 64) Compress(p);
+  std::memcpy(buf_, p, len);
+}
+
+void Sha1::Final(unsigned char* out) {
+  const uint64_t bits = len_ * 8;
+  unsigned char pad[72] = {0x80};
+  size_t used = len_ % 64;
+  size_t n = (used < 56 ? 56 : 120) - used;
+  for (int i = 0; i != 8; ++i) pad[n + i] = bits >> (56 - 8 * i);
+  Update(pad, n + 8);
+  for (int i = 0; i != 5; ++i) {
+    out[4 * i + 0] = h_[i] >> 24;
+    out[4 * i + 1] = h_[i] >> 16;
+    out[4 * i + 2] = h_[i] >> 8;
+    out[4 * i + 3] = h_[i];
+  }
+}
+
+}  // namespace gitstatus
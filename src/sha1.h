@@ -0,0 +1,47 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_SHA1_H_
+#define ROMKATV_GITSTATUS_SHA1_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace gitstatus {
+
+// Streaming SHA-1. Unlike the hash in libgit2, it doesn't detect collision attacks, which makes
+// it several times faster. It's used only to check whether files match blobs from the index.
+class Sha1 {
+ public:
+  Sha1();
+
+  void Update(const void* data, size_t len);
+
+  // Writes the 20-byte digest to `out`. The object must not be used afterwards.
+  void Final(unsigned char* out);
+
+ private:
+  void Compress(const unsigned char* block);
+
+  uint32_t h_[5];
+  uint64_t len_ = 0;
+  unsigned char buf_[64];
+};
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_SHA1_H_
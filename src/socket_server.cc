@@ -0,0 +1,227 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "socket_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#include "check.h"
+#include "logging.h"
+#include "print.h"
+#include "scope_guard.h"
+
+namespace gitstatus {
+
+namespace {
+
+constexpr int kBacklog = 128;
+
+sockaddr_un Address(const std::string& path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    LOG(ERROR) << "Socket path is too long: " << Print(path);
+    std::exit(10);
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return addr;
+}
+
+// SOCK_CLOEXEC isn't available everywhere. Where it is, the descriptor is never visible to
+// a concurrent fork() without FD_CLOEXEC.
+int Socket() {
+#ifdef SOCK_CLOEXEC
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK(fd >= 0) << Errno();
+#else
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHECK(fd >= 0) << Errno();
+  CHECK(fcntl(fd, F_SETFD, FD_CLOEXEC) != -1) << Errno();
+#endif
+  return fd;
+}
+
+int AcceptCloexec(int listen_fd) {
+#ifdef __linux__
+  return accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+#else
+  int fd = accept(listen_fd, nullptr, nullptr);
+  if (fd >= 0) CHECK(fcntl(fd, F_SETFD, FD_CLOEXEC) != -1) << Errno();
+  return fd;
+#endif
+}
+
+bool IsListening(const sockaddr_un& addr) {
+  int fd = Socket();
+  ON_SCOPE_EXIT(&) { CHECK(!close(fd)) << Errno(); };
+  return !connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+}
+
+}  // namespace
+
+SocketServer::SocketServer(std::string path, int lock_fd, int parent_pid)
+    : path_(std::move(path)), watch_(lock_fd, parent_pid) {
+  // Writing to a client that has disconnected must not kill the server.
+  CHECK(signal(SIGPIPE, SIG_IGN) != SIG_ERR) << Errno();
+
+  sockaddr_un addr = Address(path_);
+  listen_fd_ = Socket();
+
+  // Only the current user can connect.
+  mode_t mask = umask(077);
+  int err = bind(listen_fd_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+  if (err && errno == EADDRINUSE) {
+    if (IsListening(addr)) {
+      LOG(ERROR) << "Another gitstatusd is already listening on " << Print(path_);
+      std::exit(10);
+    }
+    // Never delete anything but a socket: `path` may have been given by mistake.
+    struct stat st;
+    if (!lstat(path_.c_str(), &st) && !S_ISSOCK(st.st_mode)) {
+      LOG(ERROR) << "Not a socket: " << Print(path_);
+      std::exit(10);
+    }
+    LOG(INFO) << "Replacing stale socket " << Print(path_);
+    CHECK(!unlink(path_.c_str()) || errno == ENOENT) << Errno();
+    err = bind(listen_fd_, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+  }
+  umask(mask);
+  CHECK(!err) << "bind(" << Print(path_) << "): " << Errno();
+  CHECK(!listen(listen_fd_, kBacklog)) << Errno();
+  LOG(INFO) << "Listening on " << Print(path_);
+
+#ifdef __linux__
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  CHECK(epoll_fd_ >= 0) << Errno();
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd_;
+  CHECK(!epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev)) << Errno();
+  if (watch_.fd() >= 0) {
+    ev.data.fd = watch_.fd();
+    CHECK(!epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, watch_.fd(), &ev)) << Errno();
+  }
+#endif
+}
+
+SocketServer::~SocketServer() {
+  if (epoll_fd_ >= 0) CHECK(!close(epoll_fd_)) << Errno();
+  CHECK(!close(listen_fd_)) << Errno();
+  unlink(path_.c_str());
+}
+
+bool SocketServer::ReadRequests(std::vector<Request>& res) {
+  const size_t orig_size = res.size();
+
+  while (true) {
+#ifdef __linux__
+    epoll_event events[64];
+    int n = epoll_wait(epoll_fd_, events, sizeof(events) / sizeof(*events), watch_.timeout_ms());
+    if (n < 0 && errno == EINTR) continue;
+    CHECK(n >= 0) << Errno();
+    for (int i = 0; i != n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == watch_.fd()) {
+        watch_.OnReadable();
+      } else if (fd == listen_fd_) {
+        Accept();
+      } else if (!Read(fd, res)) {
+        Disconnect(fd);
+      }
+    }
+#else
+    std::vector<pollfd> fds;
+    fds.reserve(clients_.size() + 2);
+    fds.push_back({.fd = listen_fd_, .events = POLLIN});
+    if (watch_.fd() >= 0) fds.push_back({.fd = watch_.fd(), .events = POLLIN});
+    for (const auto& kv : clients_) fds.push_back({.fd = kv.first, .events = POLLIN});
+    int n = poll(fds.data(), fds.size(), watch_.timeout_ms());
+    if (n < 0 && errno == EINTR) continue;
+    CHECK(n >= 0) << Errno();
+    for (const pollfd& pfd : fds) {
+      if (!pfd.revents) continue;
+      if (pfd.fd == watch_.fd()) {
+        watch_.OnReadable();
+      } else if (pfd.fd == listen_fd_) {
+        Accept();
+      } else if (!Read(pfd.fd, res)) {
+        Disconnect(pfd.fd);
+      }
+    }
+#endif
+    if (n == 0) watch_.Check();
+    if (res.size() != orig_size) return true;
+  }
+}
+
+void SocketServer::Accept() {
+  int fd = AcceptCloexec(listen_fd_);
+  if (fd < 0) {
+    LOG(WARN) << "accept: " << Errno();
+    return;
+  }
+  // Don't let a client that doesn't read its responses stall everyone else for long.
+  struct timeval timeout = {.tv_sec = 1};
+  CHECK(!setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) << Errno();
+
+#ifdef __linux__
+  epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  CHECK(!epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev)) << Errno();
+#endif
+  clients_.emplace(fd, RequestParser(std::make_shared<Client>(fd, true)));
+  LOG(INFO) << "Client connected on fd " << fd << "; " << clients_.size() << " client(s) total";
+}
+
+bool SocketServer::Read(int fd, std::vector<Request>& res) {
+  auto it = clients_.find(fd);
+  CHECK(it != clients_.end());
+  ssize_t n = it->second.Read(fd, res);
+  if (n < 0 && errno == EINTR) return true;
+  if (n < 0) LOG(WARN) << "Cannot read from client on fd " << fd << ": " << Errno();
+  return n > 0;
+}
+
+void SocketServer::Disconnect(int fd) {
+#ifdef __linux__
+  CHECK(!epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr)) << Errno();
+#endif
+  // The descriptor is closed once there are no requests from this client left.
+  clients_.erase(fd);
+  LOG(INFO) << "Client disconnected from fd " << fd << "; " << clients_.size()
+            << " client(s) left";
+}
+
+}  // namespace gitstatus
@@ -0,0 +1,67 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_SOCKET_SERVER_H_
+#define ROMKATV_GITSTATUS_SOCKET_SERVER_H_
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "request.h"
+
+namespace gitstatus {
+
+// Accepts any number of clients on a Unix domain socket and reads their requests. Responses to
+// requests from a client are written back to the same connection.
+//
+// Requests from all clients go to the same queue and are processed by a single worker, so a slow
+// request delays everyone. The repository cache isn't thread-safe, which rules out a worker per
+// connection.
+//
+// Uses epoll on Linux and poll elsewhere.
+class SocketServer {
+ public:
+  // Creates a socket at `path` that only the current user can connect to. A stale socket left
+  // by a dead server is replaced. Exits if another server is listening on `path` or if `path`
+  // exists and isn't a socket.
+  SocketServer(std::string path, int lock_fd, int parent_pid);
+  SocketServer(SocketServer&&) = delete;
+  ~SocketServer();
+
+  // Blocks until there is at least one complete request. Appends all complete requests to
+  // `res`. Malformed requests are skipped. Always returns true: unlike stdin, the socket has no
+  // EOF.
+  bool ReadRequests(std::vector<Request>& res);
+
+ private:
+  void Accept();
+  // Returns false if the client has disconnected.
+  bool Read(int fd, std::vector<Request>& res);
+  void Disconnect(int fd);
+
+  std::string path_;
+  ParentWatch watch_;
+  int listen_fd_ = -1;
+  int epoll_fd_ = -1;
+  std::unordered_map<int, RequestParser> clients_;
+};
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_SOCKET_SERVER_H_
@@ -0,0 +1,216 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "submodules.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "check.h"
+#include "git.h"
+#include "print.h"
+#include "scope_guard.h"
+#include "thread_pool.h"
+
+namespace gitstatus {
+
+namespace {
+
+// Values of submodule.<name>.ignore.
+enum class Ignore { kNone, kUntracked, kDirty, kAll };
+
+struct Submodule {
+  // Absolute path to the submodule's workdir with a trailing slash.
+  std::string workdir;
+  Ignore ignore;
+};
+
+struct Context {
+  RepoCache& cache;
+  // Protects `cache`.
+  std::mutex mutex;
+  Time deadline;
+  Cancellation cancel;
+  // Threads that may still be started, shared by all nesting levels so that there are never more
+  // than --num-threads of them at once, counting the calling thread.
+  std::atomic<size_t> spare_threads{0};
+};
+
+struct Result {
+  bool modified = false;
+  bool untracked = false;
+  bool complete = true;
+};
+
+// Reads submodule.<name>.ignore from the repository config or, failing that, from .gitmodules.
+Ignore GetIgnore(git_config* cfg, git_config* gitmodules, const std::string& name) {
+  std::string key = "submodule." + name + ".ignore";
+  for (git_config* c : {cfg, gitmodules}) {
+    if (!c) continue;
+    git_buf buf = {};
+    ON_SCOPE_EXIT(&) { git_buf_free(&buf); };
+    if (git_config_get_string_buf(&buf, c, key.c_str())) continue;
+    std::string val(buf.ptr, buf.size);
+    if (val == "none") return Ignore::kNone;
+    if (val == "untracked") return Ignore::kUntracked;
+    if (val == "dirty") return Ignore::kDirty;
+    if (val == "all") return Ignore::kAll;
+    LOG(WARN) << "Invalid value of " << key << ": " << Print(val);
+    return Ignore::kNone;
+  }
+  return Ignore::kNone;
+}
+
+std::vector<Submodule> ListSubmodules(Repo& repo, git_config* cfg) {
+  const std::vector<std::string>& paths = repo.Gitlinks();
+  if (paths.empty()) return {};
+  const std::string workdir = git_repository_workdir(repo.repo());
+
+  git_config* gitmodules = nullptr;
+  if (git_config_open_ondisk(&gitmodules, (workdir + ".gitmodules").c_str())) gitmodules = nullptr;
+  ON_SCOPE_EXIT(&) {
+    if (gitmodules) git_config_free(gitmodules);
+  };
+
+  // Submodules are looked up in config by name, which is mapped to path in .gitmodules. The name
+  // defaults to the path.
+  std::unordered_map<std::string, std::string> names;
+  if (gitmodules) {
+    auto Add = +[](const git_config_entry* entry, void* payload) -> int {
+      constexpr size_t kPrefix = sizeof("submodule.") - 1;
+      constexpr size_t kSuffix = sizeof(".path") - 1;
+      size_t len = std::strlen(entry->name);
+      if (len > kPrefix + kSuffix) {
+        std::string name(entry->name + kPrefix, entry->name + len - kSuffix);
+        static_cast<std::unordered_map<std::string, std::string>*>(payload)->emplace(
+            entry->value, std::move(name));
+      }
+      return 0;
+    };
+    if (git_config_foreach_match(gitmodules, "^submodule\\..*\\.path$", Add, &names)) {
+      LOG(WARN) << "Cannot parse " << Print(workdir) << ".gitmodules: " << GitError();
+    }
+  }
+
+  std::vector<Submodule> res;
+  for (const std::string& path : paths) {
+    auto it = names.find(path);
+    Ignore ignore = GetIgnore(cfg, gitmodules, it == names.end() ? path : it->second);
+    // New commits in submodules are reported by the superproject. There is nothing else to do.
+    if (ignore == Ignore::kDirty || ignore == Ignore::kAll) continue;
+    res.push_back({.workdir = workdir + path + '/', .ignore = ignore});
+  }
+  return res;
+}
+
+// Takes up to `want` threads from the spare ones.
+size_t ReserveThreads(Context& ctx, size_t want) {
+  size_t spare = ctx.spare_threads.load();
+  while (!ctx.spare_threads.compare_exchange_weak(spare, spare - std::min(spare, want))) {
+  }
+  return std::min(spare, want);
+}
+
+SubmoduleStats Scan(Context& ctx, Repo& repo, git_config* cfg);
+
+Result ScanSubmodule(Context& ctx, const Submodule& sub) {
+  Result res;
+  // If the submodule isn't checked out, its directory is either missing or empty. Discovery
+  // would find the superproject or fail, and a failure makes RepoCache forget the repos above.
+  struct stat st;
+  if (lstat((sub.workdir + ".git").c_str(), &st)) return res;
+  Repo* repo;
+  {
+    std::unique_lock<std::mutex> lock(ctx.mutex);
+    repo = ctx.cache.Open(sub.workdir, false);
+  }
+  if (!repo || sub.workdir != git_repository_workdir(repo->repo())) return res;
+
+  git_config* cfg;
+  VERIFY(!git_repository_config(&cfg, repo->repo())) << GitError();
+  ON_SCOPE_EXIT(=) { git_config_free(cfg); };
+  VERIFY(!git_config_refresh(cfg)) << GitError();
+
+  git_reference* head = Head(repo->repo());
+  if (!head) return res;
+  ON_SCOPE_EXIT(=) { git_reference_free(head); };
+
+  IndexStats stats = repo->GetIndexStats(git_reference_target(head), cfg, ctx.deadline, ctx.cancel);
+  SubmoduleStats nested = Scan(ctx, *repo, cfg);
+  res.modified = stats.num_staged || stats.num_unstaged || stats.num_conflicted ||
+                 nested.num_modified;
+  res.untracked = sub.ignore == Ignore::kNone && (stats.num_untracked || nested.num_untracked);
+  res.complete = stats.staged_complete && stats.dirty_complete && nested.complete;
+  return res;
+}
+
+SubmoduleStats Scan(Context& ctx, Repo& repo, git_config* cfg) {
+  SubmoduleStats res;
+  std::vector<Submodule> subs = ListSubmodules(repo, cfg);
+  if (subs.empty()) return res;
+  LOG(INFO) << "Scanning " << subs.size() << " submodule(s) of "
+            << Print(git_repository_workdir(repo.repo()));
+
+  std::vector<Result> results(subs.size());
+  std::atomic<size_t> next(0);
+  auto Work = [&] {
+    for (size_t i; (i = next++) < subs.size();) {
+      if (ctx.cancel.Cancelled()) return;
+      try {
+        results[i] = ScanSubmodule(ctx, subs[i]);
+      } catch (const Exception&) {
+        LOG(ERROR) << "Failed to scan submodule: " << Print(subs[i].workdir);
+        results[i].complete = false;
+      }
+    }
+  };
+
+  // GetIndexStats() blocks while its scans run on the global thread pool, so submodules are
+  // scanned from threads of their own rather than from the pool.
+  std::vector<std::thread> threads(ReserveThreads(ctx, subs.size() - 1));
+  for (std::thread& t : threads) t = std::thread(Work);
+  Work();
+  for (std::thread& t : threads) t.join();
+  ctx.spare_threads += threads.size();
+
+  for (const Result& r : results) {
+    res.num_modified += r.modified;
+    res.num_untracked += r.untracked;
+    res.complete = res.complete && r.complete;
+  }
+  return res;
+}
+
+}  // namespace
+
+SubmoduleStats GetSubmoduleStats(RepoCache& cache, Repo& repo, git_config* cfg, Time deadline,
+                                 const Cancellation& cancel) {
+  Context ctx = {.cache = cache, .deadline = deadline, .cancel = cancel};
+  ctx.spare_threads = GlobalThreadPool()->num_threads() - 1;
+  return Scan(ctx, repo, cfg);
+}
+
+}  // namespace gitstatus
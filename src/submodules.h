@@ -0,0 +1,54 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_SUBMODULES_H_
+#define ROMKATV_GITSTATUS_SUBMODULES_H_
+
+#include <cstddef>
+
+#include <git2.h>
+
+#include "cancellation.h"
+#include "repo.h"
+#include "repo_cache.h"
+#include "time.h"
+
+namespace gitstatus {
+
+struct SubmoduleStats {
+  // The number of submodules with staged, unstaged or conflicted changes, including changes in
+  // their own submodules. Submodules with new commits are reported by the superproject as
+  // unstaged changes and aren't counted here unless they have changes of their own.
+  size_t num_modified = 0;
+  // The number of submodules with untracked files, including untracked files in their own
+  // submodules.
+  size_t num_untracked = 0;
+  // If false, the deadline passed before all submodules were scanned.
+  bool complete = true;
+};
+
+// Scans checked out submodules of `repo` and, recursively, their submodules. Submodules are
+// scanned in parallel and opened through `cache`, so their state is cached between requests
+// like that of any other repository. Honors submodule.<name>.ignore from `cfg` and .gitmodules.
+//
+// `cfg` is the config of `repo`. Requires: repo.GetIndexStats() has been called.
+SubmoduleStats GetSubmoduleStats(RepoCache& cache, Repo& repo, git_config* cfg, Time deadline,
+                                 const Cancellation& cancel);
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_SUBMODULES_H_
@@ -26,6 +26,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <iterator>
+#include <limits>
 #include <utility>
 
 #include "check.h"
@@ -116,22 +117,34 @@ TagDb::~TagDb() {
   git_refdb_free(refdb_);
 }
 
-std::string TagDb::TagForCommit(const git_oid& oid) {
+bool TagDb::TagForCommit(const git_oid& oid, Time deadline, std::string& name) {
+  // Looking up a loose tag is a lot more expensive than checking a packed one.
+  constexpr size_t kPackedTagsPerClockCheck = 1024;
+
   ReadLooseTags();
   UpdatePack();
 
   std::string res;
+  auto Expired = [&] {
+    if (Clock::now() < deadline) return false;
+    LOG(INFO) << "Deadline exceeded while looking up tags";
+    name.clear();
+    return true;
+  };
 
   std::string ref = "refs/tags/";
   size_t prefix_len = ref.size();
   for (const char* tag : loose_tags_) {
+    if (Expired()) return false;
     ref.resize(prefix_len);
     ref += tag;
     if (res < tag && TagHasTarget(ref.c_str(), &oid)) res = tag;
   }
 
   if ((std::unique_lock<std::mutex>(mutex_), id2name_dirty_)) {
+    size_t n = 0;
     for (auto it = name2id_.rbegin(); it != name2id_.rend(); ++it) {
+      if (++n % kPackedTagsPerClockCheck == 0 && Expired()) return false;
       if (!memcmp((*it)->id.id, oid.id, GIT_OID_RAWSZ) && !IsLooseTag((*it)->name)) {
         if (res < (*it)->name) res = (*it)->name;
         break;
@@ -144,7 +157,8 @@ std::string TagDb::TagForCommit(const git_oid& oid) {
     }
   }
 
-  return res;
+  name = std::move(res);
+  return true;
 }
 
 void TagDb::ReadLooseTags() {
@@ -161,19 +175,33 @@ void TagDb::ReadLooseTags() {
                 /* case_sensitive = */ true);
 }
 
-void TagDb::UpdatePack() {
-  auto Reset = [&] {
-    auto Wipe = [](auto& x) {
-      x.clear();
-      x.shrink_to_fit();
-    };
-    Wait();
-    Wipe(pack_);
-    Wipe(name2id_);
-    Wipe(id2name_);
-    pack_arena_.Reuse();
-    std::memset(&pack_stat_, 0, sizeof(pack_stat_));
+size_t TagDb::MemoryUsage() const {
+  return pack_arena_.BlockBytes() + loose_arena_.BlockBytes() +
+         loose_tags_.capacity() * sizeof(loose_tags_[0]);
+}
+
+void TagDb::Shrink() {
+  ResetPack(0);
+  loose_tags_.clear();
+  loose_tags_.shrink_to_fit();
+  loose_arena_.Reuse(0);
+}
+
+void TagDb::ResetPack(size_t num_blocks) {
+  auto Wipe = [](auto& x) {
+    x.clear();
+    x.shrink_to_fit();
   };
+  Wait();
+  Wipe(pack_);
+  Wipe(name2id_);
+  Wipe(id2name_);
+  pack_arena_.Reuse(num_blocks);
+  std::memset(&pack_stat_, 0, sizeof(pack_stat_));
+}
+
+void TagDb::UpdatePack() {
+  auto Reset = [&] { ResetPack(std::numeric_limits<size_t>::max()); };
 
   std::string pack_path = git_repository_path(repo_) + "packed-refs"s;
   struct stat st;
@@ -31,6 +31,7 @@
 #include <vector>
 
 #include "arena.h"
+#include "time.h"
 
 namespace gitstatus {
 
@@ -45,11 +46,21 @@ class TagDb {
   TagDb(TagDb&&) = delete;
   ~TagDb();
 
-  std::string TagForCommit(const git_oid& oid);
+  // Sets `name` to the last tag in lexicographical order whose target is equal to the given, or
+  // to an empty string. Returns false and leaves `name` empty if the deadline passes first.
+  bool TagForCommit(const git_oid& oid, Time deadline, std::string& name);
+
+  // Approximate number of bytes of heap memory owned by TagDb. Must not be called concurrently
+  // with TagForCommit().
+  size_t MemoryUsage() const;
+
+  // Frees all memory. Tags will be read again on the next call to TagForCommit().
+  void Shrink();
 
  private:
   void ReadLooseTags();
   void UpdatePack();
+  void ResetPack(size_t num_blocks);
   void ParsePack();
   void Wait();
 
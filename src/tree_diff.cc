@@ -0,0 +1,229 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "tree_diff.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "check.h"
+#include "git.h"
+#include "scope_guard.h"
+
+namespace gitstatus {
+
+namespace {
+
+// The order of entries in tree objects: names are compared as if directories had a trailing
+// slash. It's also the order of paths in the index.
+int NameCmp(StringView x, bool x_dir, StringView y, bool y_dir) {
+  if (int cmp = std::memcmp(x.ptr, y.ptr, std::min(x.len, y.len))) return cmp;
+  unsigned char cx = x.len > y.len ? x.ptr[y.len] : x_dir ? '/' : 0;
+  unsigned char cy = y.len > x.len ? y.ptr[x.len] : y_dir ? '/' : 0;
+  return static_cast<int>(cx) - static_cast<int>(cy);
+}
+
+void FindUnchanged(git_repository* repo, const git_tree* tree, const CacheTree& node,
+                   std::string& prefix, std::vector<std::string>& res) {
+  if (node.Matches(*git_tree_id(tree))) {
+    res.push_back(prefix);
+    return;
+  }
+  for (const CacheTree& subtree : node.subtrees) {
+    std::string name(subtree.name.ptr, subtree.name.len);
+    const git_tree_entry* entry = git_tree_entry_byname(tree, name.c_str());
+    if (!entry || git_tree_entry_type(entry) != GIT_OBJECT_TREE) continue;
+    if (subtree.Matches(*git_tree_entry_id(entry))) {
+      res.push_back(prefix + name + '/');
+    } else if (!subtree.subtrees.empty()) {
+      git_tree* t;
+      VERIFY(!git_tree_lookup(&t, repo, git_tree_entry_id(entry))) << GitError();
+      ON_SCOPE_EXIT(&) { git_tree_free(t); };
+      size_t len = prefix.size();
+      prefix += name;
+      prefix += '/';
+      FindUnchanged(repo, t, subtree, prefix, res);
+      prefix.resize(len);
+    }
+  }
+}
+
+}  // namespace
+
+void TreeDiff::Run(const git_tree* tree, const Spawn& spawn) {
+  CHECK(file_.case_sensitive());
+  const CacheTree* root = file_.cache_tree();
+  if (root && root->Matches(*git_tree_id(tree))) {
+    LOG(INFO) << "Cache tree matches HEAD: no staged changes";
+    return;
+  }
+  std::string prefix;
+  Diff(tree, prefix, 0, file_.size(), root, &spawn);
+}
+
+void TreeDiff::Emit(git_delta_t status, const char* path, uint32_t old_mode, const git_oid* old_id,
+                    const git_index_entry* entry) {
+  git_diff_delta delta = {};
+  delta.status = status;
+  delta.nfiles = 2;
+  delta.old_file.path = path;
+  delta.old_file.mode = old_mode;
+  if (old_id) delta.old_file.id = *old_id;
+  delta.new_file.path = path;
+  if (entry) {
+    delta.new_file.mode = entry->mode;
+    delta.new_file.id = entry->id;
+    delta.new_file.size = entry->file_size;
+  }
+  if (!cb_(delta)) stopped_.store(true, std::memory_order_relaxed);
+}
+
+void TreeDiff::DiffSubtree(const git_oid& id, std::string& prefix, StringView name, size_t begin,
+                           size_t end, const CacheTree* node, const Spawn* spawn) {
+  if (spawn) {
+    std::string path = prefix;
+    path.append(name.ptr, name.len).push_back('/');
+    (*spawn)([this, id, path = std::move(path), begin, end, node]() mutable {
+      if (Stopped()) return;
+      git_tree* tree;
+      VERIFY(!git_tree_lookup(&tree, repo_, &id)) << GitError();
+      ON_SCOPE_EXIT(&) { git_tree_free(tree); };
+      Diff(tree, path, begin, end, node, nullptr);
+    });
+    return;
+  }
+
+  git_tree* tree;
+  VERIFY(!git_tree_lookup(&tree, repo_, &id)) << GitError();
+  ON_SCOPE_EXIT(&) { git_tree_free(tree); };
+  size_t len = prefix.size();
+  prefix.append(name.ptr, name.len).push_back('/');
+  Diff(tree, prefix, begin, end, node, nullptr);
+  prefix.resize(len);
+}
+
+// Compares `tree` (null if the directory doesn't exist in the tree) with index entries in
+// [begin, end), all of which start with `prefix`.
+void TreeDiff::Diff(const git_tree* tree, std::string& prefix, size_t begin, size_t end,
+                    const CacheTree* node, const Spawn* spawn) {
+  const size_t n = tree ? git_tree_entrycount(tree) : 0;
+  size_t t = 0;
+  size_t i = begin;
+
+  while ((t != n || i != end) && !Stopped()) {
+    const git_tree_entry* te = t != n ? git_tree_entry_byindex(tree, t) : nullptr;
+    const git_index_entry* ie = i != end ? file_.entry(i) : nullptr;
+
+    StringView tname;
+    bool tdir = false;
+    if (te) {
+      tname = StringView(git_tree_entry_name(te));
+      tdir = git_tree_entry_type(te) == GIT_OBJECT_TREE;
+    }
+    StringView iname;
+    bool idir = false;
+    if (ie) {
+      const char* name = ie->path + prefix.size();
+      const char* slash = std::strchr(name, '/');
+      idir = slash;
+      iname = slash ? StringView(name, slash) : StringView(name);
+    }
+    int cmp = !ie ? -1 : !te ? 1 : NameCmp(tname, tdir, iname, idir);
+
+    if (cmp < 0) {
+      // Only in the tree.
+      if (tdir) {
+        DiffSubtree(*git_tree_entry_id(te), prefix, tname, i, i, nullptr, spawn);
+      } else {
+        std::string path = prefix;
+        path.append(tname.ptr, tname.len);
+        Emit(GIT_DELTA_DELETED, path.c_str(), git_tree_entry_filemode(te), git_tree_entry_id(te),
+             nullptr);
+      }
+      ++t;
+      continue;
+    }
+
+    if (idir) {
+      // Entries under the same directory are contiguous.
+      const size_t len = iname.ptr - ie->path + iname.len + 1;
+      const char* dir = ie->path;
+      size_t j = std::partition_point(file_.entry(i), file_.entry(0) + end,
+                                      [&](const git_index_entry& e) {
+                                        return !std::strncmp(e.path, dir, len);
+                                      }) -
+                 file_.entry(0);
+      if (cmp == 0) {
+        const CacheTree* sub = node ? node->Find(iname) : nullptr;
+        if (!sub || !sub->Matches(*git_tree_entry_id(te))) {
+          DiffSubtree(*git_tree_entry_id(te), prefix, iname, i, j, sub, spawn);
+        }
+        ++t;
+      } else {
+        size_t len = prefix.size();
+        prefix.append(iname.ptr, iname.len).push_back('/');
+        Diff(nullptr, prefix, i, j, nullptr, nullptr);
+        prefix.resize(len);
+      }
+      i = j;
+      continue;
+    }
+
+    // A file in the index. Conflicts span several entries with the same path.
+    size_t j = i + 1;
+    bool conflicted = GIT_INDEX_ENTRY_STAGE(ie);
+    for (; j != end && !std::strcmp(file_.entry(j)->path, ie->path); ++j) {
+      conflicted = conflicted || GIT_INDEX_ENTRY_STAGE(file_.entry(j));
+    }
+
+    if (conflicted) {
+      Emit(GIT_DELTA_CONFLICTED, ie->path, te ? git_tree_entry_filemode(te) : 0,
+           te ? git_tree_entry_id(te) : nullptr, nullptr);
+    } else if (cmp) {
+      if (!(ie->flags_extended & GIT_INDEX_ENTRY_INTENT_TO_ADD)) {
+        Emit(GIT_DELTA_ADDED, ie->path, 0, nullptr, ie);
+      }
+    } else {
+      uint32_t mode = git_tree_entry_filemode(te);
+      const git_oid* id = git_tree_entry_id(te);
+      if ((mode & S_IFMT) != (ie->mode & S_IFMT)) {
+        // A type change is reported as deletion and addition.
+        Emit(GIT_DELTA_DELETED, ie->path, mode, id, nullptr);
+        Emit(GIT_DELTA_ADDED, ie->path, 0, nullptr, ie);
+      } else if (mode != ie->mode || !git_oid_equal(id, &ie->id)) {
+        Emit(GIT_DELTA_MODIFIED, ie->path, mode, id, ie);
+      }
+    }
+
+    if (cmp == 0) ++t;
+    i = j;
+  }
+}
+
+std::vector<std::string> UnchangedDirs(git_repository* repo, const git_tree* tree,
+                                       const CacheTree& cache_tree) {
+  std::vector<std::string> res;
+  std::string prefix;
+  FindUnchanged(repo, tree, cache_tree, prefix, res);
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+}  // namespace gitstatus
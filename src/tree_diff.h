@@ -0,0 +1,82 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_TREE_DIFF_H_
+#define ROMKATV_GITSTATUS_TREE_DIFF_H_
+
+#include <git2.h>
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "cache_tree.h"
+#include "index_file.h"
+
+namespace gitstatus {
+
+// Compares a tree with the entries of an index file and reports the same deltas as
+// git_diff_tree_to_index() without GIT_DIFF_INCLUDE_TYPECHANGE, minus intent-to-add entries.
+// Unlike libgit2, it walks the tree and the index in lockstep without building a diff and skips
+// subtrees whose node in the cache tree matches, so after `git add` of a single file only the
+// trees on the path to that file are loaded.
+//
+// Thread-safe: Run() and the tasks it spawns can run concurrently.
+class TreeDiff {
+ public:
+  // Called for every delta. Returns false to stop the diff.
+  using Callback = std::function<bool(const git_diff_delta& delta)>;
+  // Runs `task` at some point, possibly on another thread.
+  using Spawn = std::function<void(std::function<void()> task)>;
+
+  // Requires: file.case_sensitive(). `file` must outlive all tasks spawned by Run().
+  TreeDiff(git_repository* repo, const IndexFile& file, Callback cb)
+      : repo_(repo), file_(file), cb_(std::move(cb)) {}
+
+  TreeDiff(TreeDiff&&) = delete;
+
+  // Compares `tree` with all entries of the index. Top-level subtrees that cannot be skipped
+  // are compared by tasks handed to `spawn`. Throws on errors.
+  void Run(const git_tree* tree, const Spawn& spawn);
+
+ private:
+  bool Stopped() const { return stopped_.load(std::memory_order_relaxed); }
+  void Emit(git_delta_t status, const char* path, uint32_t old_mode, const git_oid* old_id,
+            const git_index_entry* entry);
+  void Diff(const git_tree* tree, std::string& prefix, size_t begin, size_t end,
+            const CacheTree* node, const Spawn* spawn);
+  void DiffSubtree(const git_oid& id, std::string& prefix, StringView name, size_t begin,
+                   size_t end, const CacheTree* node, const Spawn* spawn);
+
+  git_repository* const repo_;
+  const IndexFile& file_;
+  const Callback cb_;
+  std::atomic<bool> stopped_{false};
+};
+
+// Returns directories (with a trailing slash, sorted with memcmp()) whose index entries are known
+// to match `tree` thanks to the cache tree rooted at `cache_tree`. None of them is a parent of
+// another. If the whole index matches, returns a single empty string. Loads only the trees on the
+// path to invalid cache tree nodes. Throws on errors.
+std::vector<std::string> UnchangedDirs(git_repository* repo, const git_tree* tree,
+                                       const CacheTree& cache_tree);
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_TREE_DIFF_H_
@@ -0,0 +1,249 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "untracked_cache.h"
+
+#include <sys/utsname.h>
+
+#include <cstring>
+#include <utility>
+
+#include "bits.h"
+#include "check.h"
+#include "ewah.h"
+#include "git.h"
+#include "print.h"
+#include "stat.h"
+
+namespace gitstatus {
+
+namespace {
+
+constexpr size_t kHashSize = GIT_OID_RAWSZ;
+// ctime, mtime, dev, ino, uid, gid and size.
+constexpr size_t kStatSize = 36;
+
+// Flags from dir.h in git sources.
+constexpr uint32_t kShowOtherDirectories = 1 << 1;
+constexpr uint32_t kHideEmptyDirectories = 1 << 2;
+
+struct Dir {
+  UntrackedDir dir;
+  size_t parent;
+  bool valid = false;
+  bool check_only = false;
+  const char* exclude_hash = nullptr;
+};
+
+// Reads a directory block and, recursively, the blocks of its subdirectories.
+bool ReadDir(const char*& p, const char* e, size_t parent, std::vector<Dir>& dirs) {
+  size_t num_untracked, num_subdirs;
+  if (!Varint(p, e, num_untracked) || !Varint(p, e, num_subdirs)) return false;
+  if (num_untracked > static_cast<size_t>(e - p) || num_subdirs > static_cast<size_t>(e - p)) {
+    return false;
+  }
+  auto Str = [&](std::string& s) {
+    const char* nul = static_cast<const char*>(std::memchr(p, 0, e - p));
+    if (!nul) return false;
+    s.assign(p, nul);
+    p = nul + 1;
+    return true;
+  };
+
+  Dir dir;
+  dir.parent = parent;
+  std::string name;
+  if (!Str(name)) return false;
+  if (parent == static_cast<size_t>(-1)) {
+    if (!name.empty()) return false;
+  } else {
+    if (name.empty() || name.find('/') != std::string::npos) return false;
+    dir.dir.path = dirs[parent].dir.path + name + '/';
+  }
+  dir.dir.untracked.resize(num_untracked);
+  for (std::string& s : dir.dir.untracked) {
+    if (!Str(s) || s.empty()) return false;
+  }
+
+  size_t idx = dirs.size();
+  dirs.push_back(std::move(dir));
+  for (size_t i = 0; i != num_subdirs; ++i) {
+    if (!ReadDir(p, e, idx, dirs)) return false;
+  }
+  return true;
+}
+
+// Returns true if `path` has the given blob hash, or doesn't exist and the hash is null. If true,
+// appends `path` and its stat from before hashing to `files`.
+bool HashEq(const std::string& path, const char* hash,
+            std::vector<std::pair<std::string, struct stat>>& files) {
+  struct stat st;
+  if (stat(path.c_str(), &st)) st = {};
+  git_oid oid;
+  if (git_odb_hashfile(&oid, path.c_str(), GIT_OBJECT_BLOB)) std::memset(&oid, 0, sizeof(oid));
+  if (std::memcmp(oid.id, hash, kHashSize)) return false;
+  files.emplace_back(path, st);
+  return true;
+}
+
+// Returns true if the cache was written for this worktree on this kind of system.
+bool IdentMatches(StringView idents, const char* workdir) {
+  struct utsname uts;
+  if (uname(&uts)) return false;
+  std::string ident = "Location ";
+  ident.append(workdir, std::strlen(workdir) - 1);
+  ident += ", system ";
+  ident += uts.sysname;
+  ident += '\0';
+  for (size_t pos = 0; pos < idents.len;) {
+    const char* nul = static_cast<const char*>(std::memchr(idents.ptr + pos, 0, idents.len - pos));
+    size_t len = nul ? nul - (idents.ptr + pos) + 1 : idents.len - pos;
+    if (len == ident.size() && !std::memcmp(idents.ptr + pos, ident.data(), len)) return true;
+    pos += len;
+  }
+  return false;
+}
+
+}  // namespace
+
+UntrackedCache ReadUntrackedCache(const IndexFile& file, git_repository* repo, git_config* cfg) {
+  const char* p;
+  size_t len;
+  if (!file.Extension("UNTR", p, len)) return {};
+  const char* workdir = git_repository_workdir(repo);
+  if (!workdir) return {};
+
+  auto Malformed = [] {
+    LOG(WARN) << "Ignoring malformed UNTR index extension";
+    return UntrackedCache();
+  };
+
+  // The extension ends with a NUL.
+  if (len < 2 || p[len - 1]) return Malformed();
+  const char* e = p + len - 1;
+
+  size_t ident_len;
+  if (!Varint(p, e, ident_len) || ident_len > static_cast<size_t>(e - p)) return Malformed();
+  if (!IdentMatches(StringView(p, ident_len), workdir)) {
+    LOG(INFO) << "UNTR index extension was written for a different worktree";
+    return {};
+  }
+  p += ident_len;
+
+  // Stat data of info/exclude and core.excludesFile, dir_flags, their hashes and the name of
+  // per-directory exclude files.
+  if (e - p < static_cast<ptrdiff_t>(2 * kStatSize + 4 + 2 * kHashSize)) return Malformed();
+  uint32_t dir_flags = Be32(p + 2 * kStatSize);
+  const char* info_exclude_hash = p + 2 * kStatSize + 4;
+  const char* excludes_file_hash = info_exclude_hash + kHashSize;
+  p = excludes_file_hash + kHashSize;
+  const char* exclude_per_dir = p;
+  const char* nul = static_cast<const char*>(std::memchr(p, 0, e - p));
+  if (!nul) return Malformed();
+  p = nul + 1;
+
+  if ((dir_flags & ~kHideEmptyDirectories) != kShowOtherDirectories ||
+      std::strcmp(exclude_per_dir, ".gitignore")) {
+    LOG(INFO) << "UNTR index extension has unsupported flags";
+    return {};
+  }
+  UntrackedCache res;
+  if (!HashEq(git_repository_commondir(repo) + std::string("info/exclude"), info_exclude_hash,
+              res.ignore_files)) {
+    LOG(INFO) << "UNTR index extension is stale: info/exclude has changed";
+    return {};
+  }
+  std::string excludes_file = ExcludesFile(cfg);
+  if (!HashEq(excludes_file, excludes_file_hash, res.ignore_files)) {
+    LOG(INFO) << "UNTR index extension is stale: " << Print(excludes_file) << " has changed";
+    return {};
+  }
+
+  size_t num_dirs;
+  if (p == e) return {};
+  if (!Varint(p, e, num_dirs)) return Malformed();
+  if (!num_dirs) return {};
+
+  std::vector<Dir> dirs;
+  if (!ReadDir(p, e, -1, dirs) || dirs.size() != num_dirs) return Malformed();
+
+  Bitmap valid, check_only, hash_valid;
+  if (!ReadEwah(p, e, valid) || !ReadEwah(p, e, check_only) || !ReadEwah(p, e, hash_valid)) {
+    return Malformed();
+  }
+
+  bool ok = true;
+  check_only.ForEach([&](size_t i) {
+    if (i < dirs.size()) {
+      dirs[i].check_only = true;
+    } else {
+      ok = false;
+    }
+  });
+  valid.ForEach([&](size_t i) {
+    if (i >= dirs.size() || e - p < static_cast<ptrdiff_t>(kStatSize)) {
+      ok = false;
+      return;
+    }
+    UntrackedDir& dir = dirs[i].dir;
+    dir.mtime.tv_sec = Be32(p + 8);
+    dir.mtime.tv_nsec = Be32(p + 12);
+    dir.ino = Be32(p + 20);
+    dir.size = Be32(p + 32);
+    dirs[i].valid = true;
+    p += kStatSize;
+  });
+  hash_valid.ForEach([&](size_t i) {
+    if (i >= dirs.size() || e - p < static_cast<ptrdiff_t>(kHashSize)) {
+      ok = false;
+      return;
+    }
+    dirs[i].exclude_hash = p;
+    p += kHashSize;
+  });
+  if (!ok || p != e) return Malformed();
+
+  // A directory can be trusted only if neither its .gitignore nor that of any of its ancestors
+  // has changed. Parents come before children, so a single pass is enough.
+  static constexpr char kNullHash[kHashSize] = {};
+  // A directory whose mtime isn't older than the index might have changed after git listed it
+  // without getting a new mtime. Such listings are racy and can't be trusted.
+  const struct timespec& index_mtime = MTim(file.st());
+  auto Racy = [&](const struct timespec& t) {
+    return t.tv_sec > index_mtime.tv_sec ||
+           (t.tv_sec == index_mtime.tv_sec && t.tv_nsec >= index_mtime.tv_nsec);
+  };
+  std::vector<char> trusted(dirs.size());
+  for (size_t i = 0; i != dirs.size(); ++i) {
+    Dir& dir = dirs[i];
+    if (dir.parent != static_cast<size_t>(-1) && !trusted[dir.parent]) continue;
+    std::string gitignore = workdir + dir.dir.path + ".gitignore";
+    if (!HashEq(gitignore, dir.exclude_hash ? dir.exclude_hash : kNullHash, res.ignore_files)) {
+      continue;
+    }
+    trusted[i] = true;
+    if (dir.valid && !dir.check_only && !Racy(dir.dir.mtime)) {
+      res.dirs.push_back(std::move(dir.dir));
+    }
+  }
+
+  LOG(INFO) << "Found " << res.dirs.size() << " usable director(ies) out of " << dirs.size()
+            << " in UNTR index extension";
+  return res;
+}
+
+}  // namespace gitstatus
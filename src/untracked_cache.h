@@ -0,0 +1,66 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_UNTRACKED_CACHE_H_
+#define ROMKATV_GITSTATUS_UNTRACKED_CACHE_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <git2.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "index_file.h"
+
+namespace gitstatus {
+
+// A directory from the untracked cache that git keeps in the index (the UNTR extension) when
+// core.untrackedCache is enabled.
+struct UntrackedDir {
+  // Relative to workdir with a trailing slash. Empty for the root.
+  std::string path;
+  // Stat of the directory as recorded by git. Inode and size are truncated to 32 bits.
+  struct timespec mtime;
+  uint32_t ino;
+  uint32_t size;
+  // Untracked files and directories that aren't ignored. Directories have a trailing slash.
+  std::vector<std::string> untracked;
+};
+
+struct UntrackedCache {
+  std::vector<UntrackedDir> dirs;
+  // Ignore files that the listings in `dirs` depend on, with their stat from just before their
+  // content was checked against the cache. Missing files have zero stat. Listings leave out
+  // ignored files, so none of them can be trusted once any of these files changes.
+  std::vector<std::pair<std::string, struct stat>> ignore_files;
+};
+
+// Returns directories from the UNTR extension of `file` whose listing can still be trusted as far
+// as ignore rules are concerned: the cache was written for this worktree, and neither global
+// excludes nor .gitignore files in the directory and its ancestors have changed since. The
+// caller must still compare the stat of each directory before using its listing.
+//
+// Reads every .gitignore mentioned in the cache, so it's meant to be called once per repository.
+UntrackedCache ReadUntrackedCache(const IndexFile& file, git_repository* repo, git_config* cfg);
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_UNTRACKED_CACHE_H_
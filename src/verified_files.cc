@@ -0,0 +1,77 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include "verified_files.h"
+
+#include "logging.h"
+#include "print.h"
+#include "stat.h"
+
+namespace gitstatus {
+
+namespace {
+
+// The table is cleared when it grows beyond this many files. It normally stays tiny: only files
+// whose stat in the index is stale end up here.
+constexpr size_t kMaxFiles = 1 << 16;
+
+bool TimeEq(const struct timespec& x, const struct timespec& y) {
+  return x.tv_sec == y.tv_sec && x.tv_nsec == y.tv_nsec;
+}
+
+}  // namespace
+
+void VerifiedFiles::Add(const git_index_entry& entry, const struct stat& st, time_t checked_at) {
+  // With one-second timestamp granularity, a file modified in the same second as it was read
+  // could be modified again without changing its stat.
+  if (MTim(st).tv_sec >= checked_at || CTim(st).tv_sec >= checked_at) return;
+  File file = {.id = entry.id,
+               .entry_mode = entry.mode,
+               .mtime = MTim(st),
+               .ctime = CTim(st),
+               .ino = st.st_ino,
+               .size = st.st_size,
+               .mode = st.st_mode};
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (files_.size() >= kMaxFiles) {
+    LOG(INFO) << "Too many verified files; forgetting them all";
+    files_.clear();
+  }
+  files_[entry.path] = file;
+}
+
+bool VerifiedFiles::Contains(const git_index_entry& entry, const struct stat& st) const {
+  if (GIT_INDEX_ENTRY_STAGE(&entry) || (entry.flags_extended & GIT_INDEX_ENTRY_INTENT_TO_ADD)) {
+    return false;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = files_.find(entry.path);
+  if (it == files_.end()) return false;
+  const File& file = it->second;
+  return git_oid_equal(&file.id, &entry.id) && file.entry_mode == entry.mode &&
+         TimeEq(file.mtime, MTim(st)) && TimeEq(file.ctime, CTim(st)) && file.ino == st.st_ino &&
+         file.size == st.st_size && file.mode == st.st_mode;
+}
+
+size_t VerifiedFiles::MemoryUsage() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  size_t res = files_.bucket_count() * sizeof(void*);
+  for (const auto& kv : files_) res += sizeof(kv) + 2 * sizeof(void*) + kv.first.capacity();
+  return res;
+}
+
+}  // namespace gitstatus
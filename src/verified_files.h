@@ -0,0 +1,72 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef ROMKATV_GITSTATUS_VERIFIED_FILES_H_
+#define ROMKATV_GITSTATUS_VERIFIED_FILES_H_
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include <git2.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace gitstatus {
+
+// Remembers files whose content has been verified to match their index entries even though their
+// stat doesn't (e.g. they were touched, or the index entry is racily clean). Git would refresh
+// stat data in the index at this point but gitstatusd must not write the index, so the results
+// are kept on the side. As long as the file's stat and the blob and mode in the index stay the
+// same, the file is known to be clean without being read again.
+//
+// Thread-safe.
+class VerifiedFiles {
+ public:
+  // Records that the file at `entry.path` with stat `st` matches `entry.id` and `entry.mode`.
+  // Ignored if the file has been modified too recently for its mtime to catch subsequent
+  // modifications. `checked_at` is the wall time from before the file was read.
+  void Add(const git_index_entry& entry, const struct stat& st, time_t checked_at);
+
+  // Returns true if the file at `entry.path` with stat `st` has been verified to match
+  // `entry.id` and `entry.mode`.
+  bool Contains(const git_index_entry& entry, const struct stat& st) const;
+
+  size_t MemoryUsage() const;
+
+ private:
+  struct File {
+    git_oid id;
+    // Mode of the index entry. The rest are from the stat of the file.
+    uint32_t entry_mode;
+    struct timespec mtime;
+    struct timespec ctime;
+    ino_t ino;
+    off_t size;
+    mode_t mode;
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, File> files_;
+};
+
+}  // namespace gitstatus
+
+#endif  // ROMKATV_GITSTATUS_VERIFIED_FILES_H_
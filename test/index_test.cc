@@ -0,0 +1,93 @@
+// Copyright 2019 Roman Perepelitsa.
+//
+// This file is part of GitStatus.
+//
+// GitStatus is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// GitStatus is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with GitStatus. If not, see <https://www.gnu.org/licenses/>.
+
+#include <git2.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+#include "check.h"
+#include "index.h"
+#include "string_view.h"
+
+namespace gitstatus {
+namespace {
+
+// Returns HashTracked() of directory `path` with the specified tracked files and subdirectories.
+uint64_t Hash(std::string path, std::vector<std::string> files, std::vector<std::string> subdirs) {
+  std::vector<std::string> paths;
+  for (const std::string& file : files) paths.push_back(path + file);
+  std::vector<git_index_entry> entries(paths.size());
+  Arena arena;
+  IndexDir dir(&arena);
+  dir.path = StringView(path);
+  for (size_t i = 0; i != paths.size(); ++i) {
+    entries[i].path = paths[i].c_str();
+    dir.files.push_back(&entries[i]);
+  }
+  for (const std::string& subdir : subdirs) dir.subdirs.push_back(StringView(subdir));
+  return HashTracked(dir);
+}
+
+// A directory inherits the untracked cache of its namesake from the previous version of the
+// index when their hashes are equal, so any change in its listing of tracked names must change
+// the hash.
+
+void TestUnchanged() {
+  CHECK(Hash("d/", {"a", "b"}, {"x", "y"}) == Hash("d/", {"a", "b"}, {"x", "y"}));
+  // Only names relative to the directory matter.
+  CHECK(Hash("d/", {"a"}, {"x"}) == Hash("e/f/", {"a"}, {"x"}));
+}
+
+void TestRenameFile() {
+  CHECK(Hash("d/", {"a", "b"}, {"x"}) != Hash("d/", {"a", "c"}, {"x"}));
+  CHECK(Hash("d/", {"a"}, {}) != Hash("d/", {"b"}, {}));
+}
+
+void TestRenameSubdir() {
+  CHECK(Hash("d/", {"a"}, {"x"}) != Hash("d/", {"a"}, {"y"}));
+  CHECK(Hash("", {}, {"x", "y"}) != Hash("", {}, {"x", "z"}));
+}
+
+void TestRetype() {
+  // File d/x has been replaced with directory d/x/ that has tracked files.
+  CHECK(Hash("d/", {"a", "x"}, {}) != Hash("d/", {"a"}, {"x"}));
+  // Directory d/x/ has been replaced with file d/x.
+  CHECK(Hash("d/", {}, {"x"}) != Hash("d/", {"x"}, {}));
+  // Directory d/x/ has lost its last tracked file, so it's gone from the index.
+  CHECK(Hash("d/", {"a"}, {"x"}) != Hash("d/", {"a"}, {}));
+}
+
+void TestNameBoundaries() {
+  CHECK(Hash("d/", {"ab", "c"}, {}) != Hash("d/", {"a", "bc"}, {}));
+  CHECK(Hash("d/", {}, {"ab", "c"}) != Hash("d/", {}, {"a", "bc"}));
+}
+
+}  // namespace
+}  // namespace gitstatus
+
+int main() {
+  using namespace gitstatus;
+  TestUnchanged();
+  TestRenameFile();
+  TestRenameSubdir();
+  TestRetype();
+  TestNameBoundaries();
+  std::cout << "index_test: OK" << std::endl;
+}